@@ -25,9 +25,23 @@
 
 #import <Foundation/Foundation.h>
 #import <MUKNetworking/MUKURLConnection.h>
+#import <MUKNetworking/MUKURLConnectionQueueJournal.h>
+#import <MUKNetworking/MUKURLConnectionScheduler.h>
 
 extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
 
+/**
+ Stage a connection should reach in order to satisfy a dependency.
+ */
+typedef enum {
+    /** Dependency has received its response. */
+    MUKURLConnectionQueueDependencyStageResponse = 0,
+    /** Dependency has received a given number of bytes. */
+    MUKURLConnectionQueueDependencyStageReceivedBytes,
+    /** Dependency has finished successfully. */
+    MUKURLConnectionQueueDependencyStageFinish
+} MUKURLConnectionQueueDependencyStage;
+
 /**
  This class is used to enqueue a number of URL connections.
  
@@ -39,6 +53,40 @@ extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
  background task before to add connection and ending that background task after
  connectionDidFinishHandler is invoked.
  
+ Queue starts pending connections in earliest-deadline-first order: connections
+ with a [MUKURLConnection deadline] are started before connections without one,
+ and connections with the same deadline (or without any) are started in the
+ same order they were enqueued. A connection which can not meet its deadline is
+ cancelled, both while it waits to be started and while it is transferring data;
+ its [MUKURLConnection deadlineExpired] is set to `YES`. Ordering only matters
+ while connections compete for slots: set a finite maximumConcurrentConnections
+ (or a scheduler), otherwise every connection is started as soon as it is
+ enqueued.
+ 
+ Queue can also prefetch requests you expect to need soon (see 
+ addPrefetchRequest:). Prefetches only use spare capacity and, if you enqueue a
+ connection for a request which is being prefetched (or which has been 
+ prefetched), that connection is fed by the prefetch instead of performing a new
+ transfer.
+ 
+ Queue can also batch small requests (see batchEndpointPath): eligible
+ connections to the same host which are enqueued within batchingInterval share
+ one multipart/mixed round trip, and every part of the reply is delivered to its
+ connection handlers like it was a separate transfer.
+ 
+ Connections can depend on other connections in the same queue (see
+ addDependency:toConnection:stage:). A dependent connection is started as soon
+ as its dependencies reach the required stage, which could be well before they
+ finish, so you do not need to chain connections in completion handlers.
+ 
+ Queue can also hold low-priority traffic (see maximumDeferralInterval):
+ [MUKURLConnection deferrable] connections are released together when another
+ connection is already using the network, or when they have waited long enough.
+ 
+ Many queues can share a connection budget through a MUKURLConnectionScheduler
+ (see scheduler): a connection is started only when both queue and scheduler
+ have a free slot.
+ 
  @warning If you call [MUKURLConnection cancel], connection will be cancelled
  also from queue execution.
  @warning When queue is not deallocated until every connection finishes or it
@@ -53,6 +101,9 @@ extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
  Default: `MUKURLConnectionQueueDefaultMaxConcurrentConnections`,
  which means the value is determined dynamically by the 
  queue based on current system conditions.
+ 
+ With the default value connections are not held by the receiver, so
+ they are not started in earliest-deadline-first order.
  */
 @property (nonatomic) NSInteger maximumConcurrentConnections;
 /**
@@ -76,8 +127,134 @@ extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
  queue (or added to the queue later) and are not yet executing are
  prevented from starting until the queue is resumed. Suspending a 
  queue does not stop operations that are already running.
+ 
+ You can set this property from any thread: queue is resumed on main queue.
  */
 @property (nonatomic, getter = isSuspended) BOOL suspended;
+/**
+ Minimum time a pending connection should have before its deadline in order to
+ be started.
+ 
+ Default: `0`, which means a pending connection is dropped only when its 
+ [MUKURLConnection deadline] is passed.
+ 
+ Set a positive interval (e.g. a typical transfer duration) in order to drop
+ pending connections which are too close to their deadline to be completed
+ in time, instead of wasting a slot for them.
+ */
+@property (nonatomic) NSTimeInterval minimumTimeToDeadline;
+/**
+ Scheduler which enforces a connection budget shared with other queues.
+ 
+ Default: `nil`, which means only maximumConcurrentConnections limits the
+ receiver.
+ 
+ Assign the same scheduler (e.g. 
+ [MUKURLConnectionScheduler sharedScheduler]) to many queues in order to bound
+ their total concurrency. maximumConcurrentConnections is still enforced, so a 
+ queue never exceeds its own limit, even when it could borrow idle capacity.
+ 
+ @see schedulerWeight
+ */
+@property (nonatomic, strong) MUKURLConnectionScheduler *scheduler;
+/**
+ Weight of the receiver while scheduler splits its budget among busy queues.
+ 
+ Default: `1`. A queue with weight `2` is guaranteed twice the slots of a queue
+ with weight `1`. A queue with weight `0` only uses idle capacity.
+ */
+@property (nonatomic) NSUInteger schedulerWeight;
+/**
+ Journal where queue records enqueued connections, their progress and their
+ completion.
+ 
+ Default: `nil`, which means connections are not recorded.
+ 
+ Set a journal before to enqueue connections, so pending connections survive
+ process termination.
+ 
+ @see addJournaledConnectionsWithConfigurationHandler:
+ */
+@property (nonatomic, strong) MUKURLConnectionQueueJournal *journal;
+/**
+ Maximum number of bytes of prefetched data kept in memory, waiting for a
+ connection to ask for them.
+ 
+ Default: `2` MB. When a completed prefetch exceeds this size, least recently
+ prefetched data is discarded first. Data larger than this size is not kept.
+ 
+ @see addPrefetchRequest:
+ */
+@property (nonatomic) NSUInteger prefetchedDataCapacity;
+/**
+ Time prefetched data is kept in memory, waiting for a connection to ask for it.
+ 
+ Default: `60` seconds. Older data is discarded, so it is never fed to a
+ connection.
+ 
+ @see addPrefetchRequest:
+ */
+@property (nonatomic) NSTimeInterval prefetchedDataLifetime;
+/**
+ Path of the endpoint which accepts batch requests, resolved against the URL of
+ batched connections (e.g. `@"/batch"`).
+ 
+ Default: `nil`, which means connections are never batched.
+ 
+ When set, eligible connections are gathered per host (scheme, host and port)
+ for batchingInterval. Gathered connections are sent with a single `POST` whose 
+ body is a `multipart/mixed` message with an `application/http` part per 
+ request, identified by a `Content-ID` header. Request bodies are carried in
+ their parts, with a `Content-Length` header. Reply is expected to be a 
+ `multipart/mixed` message too: parts are matched by `Content-ID` (which 
+ should contain the same `item-N` token) or, if missing, by position.
+ 
+ Every batched connection is fed with its part like with a normal transfer, so
+ responseHandler, progressHandler and completionHandler of 
+ MUKURLConnection are called as usual. A connection which does not get a valid
+ part (e.g. because batch request fails) performs its own transfer, as soon as
+ it gets a slot like any other pending connection.
+ 
+ A batch takes a single slot of maximumConcurrentConnections and it is 
+ scheduled with the earliest deadline of its connections.
+ */
+@property (nonatomic, copy) NSString *batchEndpointPath;
+/**
+ Time window during which eligible connections to the same host are gathered
+ into a batch.
+ 
+ Default: `0.05` seconds. Window is opened by first gathered connection.
+ */
+@property (nonatomic) NSTimeInterval batchingInterval;
+/**
+ Maximum number of connections in a batch.
+ 
+ Default: `20`. Batch is sent as soon as it is full, even if batchingInterval
+ is not elapsed. A value lower than `2` disables batching.
+ */
+@property (nonatomic) NSUInteger maximumBatchSize;
+/**
+ Maximum time a [MUKURLConnection deferrable] connection is held before to be
+ started.
+ 
+ Default: `0`, which means deferrable connections are treated like other
+ connections.
+ 
+ When positive, deferrable connections are held instead of becoming pending.
+ Held connections are released in a single burst, so they share one radio 
+ wakeup, as soon as:
+ 
+ - a connection which is not deferrable is started (radio is already up);
+ - oldest held connection has been waiting for this interval (measured with 
+ currentDateHandler);
+ - you call releaseDeferredConnections.
+ 
+ Released connections are scheduled like the others, so they still respect
+ maximumConcurrentConnections, deadlines and dependencies. A deferrable 
+ connection whose [MUKURLConnection deadline] (minus minimumTimeToDeadline)
+ comes before the end of the window is not held at all.
+ */
+@property (nonatomic) NSTimeInterval maximumDeferralInterval;
 
 /** @name Handlers */
 /**
@@ -92,6 +269,36 @@ extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
  @see didFinishConnection:cancelled:
  */
 @property (nonatomic, copy) void (^connectionDidFinishHandler)(MUKURLConnection *connection, BOOL cancelled);
+/**
+ Handler called (on main queue) as a batch of connections has been removed
+ from queue.
+ 
+ @see didFinishConnections:cancelledConnections:
+ */
+@property (nonatomic, copy) void (^connectionsDidFinishHandler)(NSArray *connections, NSArray *cancelledConnections);
+/**
+ Handler called (on main queue) as connection is enqueued, in order to know
+ if it could be batched.
+ 
+ Default: `nil`, which means `GET` requests without a body are batched. 
+ Requests which are not `http` or `https`, and requests with a body stream, are
+ never batched.
+ 
+ @see batchEndpointPath
+ */
+@property (nonatomic, copy) BOOL (^shouldBatchConnectionHandler)(MUKURLConnection *connection);
+/**
+ Handler called (on main queue) in order to know current date while measuring
+ deferral windows.
+ 
+ Default: `nil`, which means `[NSDate date]` is used. Set a handler to inject
+ your own clock (e.g. in tests). Deferral windows are evaluated as connections
+ are enqueued and when the time the clock needs to reach end of window is 
+ elapsed.
+ 
+ @see maximumDeferralInterval
+ */
+@property (nonatomic, copy) NSDate* (^currentDateHandler)(void);
 
 /** @name Methods */
 /**
@@ -126,6 +333,104 @@ extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
  executing.
  */
 - (BOOL)addConnections:(NSArray *)connections;
+/**
+ Enqueues connections which were pending in journal when process was
+ terminated.
+ 
+ Journal is read in one pass and a new connection is created for every pending
+ record. Then configurationHandler is called for every connection, in order to
+ set handlers, and connections are enqueued together.
+ 
+ @param configurationHandler Block called for every recovered connection 
+ before it is enqueued. It could be `nil`.
+ @return Recovered connections which have been enqueued, or `nil` if
+ they could not be inserted.
+ @see journal
+ */
+- (NSArray *)addJournaledConnectionsWithConfigurationHandler:(void (^)(MUKURLConnection *connection))configurationHandler;
+/**
+ Prefetches a request using spare capacity of the queue.
+ 
+ Prefetch is started only when no other connection is waiting to be started,
+ so it never delays your connections. With the default 
+ maximumConcurrentConnections, a prefetch is started only while no other 
+ connection is running. Prefetched data is kept in memory, within
+ prefetchedDataCapacity and prefetchedDataLifetime.
+ 
+ If you enqueue a connection whose request is a `GET` without a body, with the
+ same URL and the same header fields, connection is fed by the prefetch: 
+ buffered data is replayed immediately (and further data is received as 
+ prefetch goes on), so connection callbacks are called like with a normal 
+ transfer. A pending prefetch is promoted in place to a normal connection.
+ 
+ Prefetches are not returned by connections and they are not notified through
+ queue callbacks. Prefetches and prefetched data are discarded when
+ application receives a memory warning.
+ 
+ @param request The request to prefetch. It should be a `GET` without a body.
+ A request which is already prefetched is ignored.
+ @return `YES` if prefetch can be inserted.
+ @see cancelPrefetches
+ */
+- (BOOL)addPrefetchRequest:(NSURLRequest *)request;
+/**
+ Cancels prefetches, both pending and running, and discards prefetched data.
+ 
+ Prefetches which are feeding a connection are not cancelled.
+ This method is called automatically when application receives a memory 
+ warning. Call it on main queue.
+ */
+- (void)cancelPrefetches;
+/**
+ Makes a connection wait for another connection to reach a stage.
+ 
+ Connection is not started until every dependency is satisfied; pending
+ connections which are not blocked are started in the meanwhile, so the queue 
+ stays busy. Dependency is satisfied as dependency connection receives its
+ response (`MUKURLConnectionQueueDependencyStageResponse`) or as it finishes 
+ successfully (`MUKURLConnectionQueueDependencyStageFinish`). For
+ `MUKURLConnectionQueueDependencyStageReceivedBytes` use 
+ addDependency:toConnection:receivedBytesCount:.
+ 
+ When a connection is cancelled, every connection which depends on it is 
+ cancelled too, and so on down the graph. When a connection fails before
+ satisfying a dependency, dependent connection is cancelled.
+ 
+ Add dependencies on main queue, before to enqueue dependent connection: the
+ call is ignored if connection is already enqueued. Dependency should be 
+ enqueued in the receiver before connection (or together with it). If
+ dependency has already left the receiver when connection is enqueued, 
+ dependency is satisfied if it succeeded, otherwise connection is cancelled. A
+ dependency which has never been enqueued in the receiver is ignored.
+ 
+ @param dependency Connection which should reach stage.
+ @param connection Connection which waits for dependency.
+ @param stage Stage dependency should reach.
+ @warning Don't create cycles: connections in a cycle are never started.
+ */
+- (void)addDependency:(MUKURLConnection *)dependency toConnection:(MUKURLConnection *)connection stage:(MUKURLConnectionQueueDependencyStage)stage;
+/**
+ Makes a connection wait for another connection to receive a number of bytes.
+ 
+ It behaves like addDependency:toConnection:stage: with
+ `MUKURLConnectionQueueDependencyStageReceivedBytes` stage. Dependency is also
+ satisfied if dependency connection finishes successfully before to receive
+ `bytesCount` bytes.
+ 
+ @param dependency Connection which should receive data.
+ @param connection Connection which waits for dependency.
+ @param bytesCount Number of bytes dependency should receive.
+ */
+- (void)addDependency:(MUKURLConnection *)dependency toConnection:(MUKURLConnection *)connection receivedBytesCount:(long long)bytesCount;
+/**
+ Releases every deferred connection, so it is scheduled like other pending
+ connections.
+ 
+ Call it on main queue (e.g. as application is about to be suspended).
+ 
+ @see maximumDeferralInterval
+ */
+- (void)releaseDeferredConnections;
 /**
  Connections queued at this moment.
  @return Connections in the queue, which could be either executing
@@ -138,7 +443,9 @@ extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
  This method sends a cancel message to all connections currently in the queue.
  
  @warning didFinishConnection:cancelled: is not called synchronously in this method,
- but in the moment connection is put outside the queue.
+ but in the moment connection is put outside the queue. Cancelled connections are
+ delivered in batches, so cancelling many connections wakes main queue up few
+ times.
  */
 - (void)cancelAllConnections;
 @end
@@ -160,6 +467,8 @@ extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
  Callback called (on main dispatch queue) as connection has been removed from queue.
  
  `cancelled` is `YES` if connection has been removed from queue after cancellation.
+ If connection has been cancelled by the queue because it could not meet its
+ deadline, [MUKURLConnection deadlineExpired] is `YES`.
  
  Execution is guaranteed in background, because task is ended after callback
  returns.
@@ -174,4 +483,21 @@ extern NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections;
  to observe queue status.
  */
 - (void)didFinishConnection:(MUKURLConnection *)connection cancelled:(BOOL)cancelled;
+/**
+ Callback called (on main dispatch queue) as a batch of connections has been 
+ removed from queue.
+ 
+ Connections which finish in the meanwhile are coalesced and delivered together
+ in the next main run loop turn, so finishing or cancelling many connections
+ costs one main thread wakeup. This callback is called after 
+ didFinishConnection:cancelled: has been called for every connection in batch.
+ 
+ Default implementation calls connectionsDidFinishHandler.
+ 
+ @param connections Connections which have been removed from queue, in the
+ same order they have finished.
+ @param cancelledConnections Connections in `connections` which have been 
+ removed from queue because of a cancellation.
+ */
+- (void)didFinishConnections:(NSArray *)connections cancelledConnections:(NSArray *)cancelledConnections;
 @end
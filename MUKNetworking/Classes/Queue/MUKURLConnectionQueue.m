@@ -26,19 +26,207 @@
 #import "MUKURLConnectionQueue.h"
 #import "MUKURLConnectionOperation_.h"
 #import "MUKURLConnectionQueue_Background.h"
+#import "MUKURLConnection_Queue.h"
+#import "MUKURLConnectionQueueJournal_Queue.h"
+#import "MUKURLConnectionBatch_.h"
+#import "MUKURLConnectionDependency_.h"
+#import "MUKURLConnectionScheduler_Queue.h"
+#import "MUKURLConnectionQueue_Scheduler.h"
 
 NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections = NSOperationQueueDefaultMaxConcurrentOperationCount;
 
+static NSString *const kPrefetchedResponseKey = @"response";
+static NSString *const kPrefetchedDataKey = @"data";
+static NSString *const kPrefetchedDateKey = @"date";
+
+static NSComparisonResult ComparePendingOperations_(MUKURLConnectionOperation_ *op1, MUKURLConnectionOperation_ *op2)
+{
+    // Earliest deadline first, then FIFO
+    NSDate *deadline1 = op1.pendingDeadline, *deadline2 = op2.pendingDeadline;
+    
+    if (deadline1 && deadline2) {
+        NSComparisonResult result = [deadline1 compare:deadline2];
+        if (result != NSOrderedSame) {
+            return result;
+        }
+    }
+    else if (deadline1) {
+        return NSOrderedAscending;
+    }
+    else if (deadline2) {
+        return NSOrderedDescending;
+    }
+    
+    if (op1.sequenceNumber < op2.sequenceNumber) return NSOrderedAscending;
+    if (op1.sequenceNumber > op2.sequenceNumber) return NSOrderedDescending;
+    return NSOrderedSame;
+}
+
 @interface MUKURLConnectionQueue ()
 @property (nonatomic, strong) NSOperationQueue *queue_;
 
+// Main queue only
+@property (nonatomic, strong) NSMutableArray *pendingOperations_;
+@property (nonatomic, strong) NSMutableArray *pendingPrefetchOperations_;
+@property (nonatomic, strong) NSMutableSet *admittedOperations_;
+@property (nonatomic) NSUInteger nextSequenceNumber_;
+@property (nonatomic, strong) NSTimer *deadlineTimer_;
+// Operations with a deadline, sorted like pending lane and split by admission
+@property (nonatomic, strong) NSMutableArray *deadlineOperations_, *admittedDeadlineOperations_;
+@property (nonatomic, strong) NSMutableDictionary *prefetchOperations_, *prefetchedResults_;
+// Keys of prefetched results, oldest first
+@property (nonatomic, strong) NSMutableArray *prefetchedKeys_;
+@property (nonatomic) NSUInteger prefetchedDataSize_;
+@property (nonatomic, strong) NSMutableDictionary *gatheringOperations_;
+@property (nonatomic, strong) NSMutableDictionary *operationsByConnection_;
+@property (nonatomic, strong) NSMutableSet *blockedOperations_;
+@property (nonatomic, strong) NSMutableDictionary *dependenciesByConnection_, *dependenciesByDependency_;
+@property (nonatomic, strong) NSMutableArray *deferredOperations_;
+@property (nonatomic, strong) NSTimer *deferralTimer_;
+
+// Any thread, synchronized on itself
+@property (nonatomic, strong) NSMutableArray *finishedOperations_;
+
+- (void)performOnMainQueue_:(void (^)(void))block;
 - (MUKURLConnectionOperation_ *)newOperationFromConnection_:(MUKURLConnection *)connection;
+- (void)enqueuePendingOperations_:(NSArray *)operations;
+- (void)routeOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)operationDidFinish_:(MUKURLConnectionOperation_ *)op;
+- (void)enqueueFinishedOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)drainFinishedOperations_;
+
+- (NSString *)prefetchKeyForRequest_:(NSURLRequest *)request;
+- (MUKURLConnectionOperation_ *)newPrefetchOperationFromRequest_:(NSURLRequest *)request;
+- (void)promotePrefetchOperation_:(MUKURLConnectionOperation_ *)op;
+- (BOOL)followPrefetchIfPossible_:(MUKURLConnectionOperation_ *)op;
+- (void)startFollowerOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)prefetchOperationDidFinish_:(MUKURLConnectionOperation_ *)op;
+- (void)didReceiveMemoryWarning_:(NSNotification *)notification;
+- (void)feedConnection_:(MUKURLConnection *)connection withResponse:(NSURLResponse *)response data:(NSData *)data;
+- (NSDictionary *)prefetchedResultForKey_:(NSString *)key;
+- (void)removeExpiredPrefetchedResults_;
+- (void)storePrefetchedResponse_:(NSURLResponse *)response data:(NSData *)data forKey:(NSString *)key;
+- (void)removePrefetchedResultForKey_:(NSString *)key;
+- (void)removeAllPrefetchedResults_;
+
+- (NSString *)batchKeyForOperation_:(MUKURLConnectionOperation_ *)op;
+- (BOOL)gatherOperationIfPossible_:(MUKURLConnectionOperation_ *)op;
+- (void)flushGatheredOperationsForKey_:(NSString *)key;
+- (MUKURLConnectionOperation_ *)newBatchOperationFromOperations_:(NSArray *)operations;
+- (void)startBatchedOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)batchOperationDidFinish_:(MUKURLConnectionOperation_ *)op;
+
+- (id)keyForConnection_:(MUKURLConnection *)connection;
+- (void)addDependency_:(MUKURLConnectionDependency_ *)dependency;
+- (void)removeDependency_:(MUKURLConnectionDependency_ *)dependency;
+- (BOOL)isBlockedOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)routeOperationIfUnblocked_:(MUKURLConnectionOperation_ *)op;
+- (void)resolveDependenciesOfEnqueuedOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)connectionDidProgressInOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)resolveDependenciesOfFinishedOperation_:(MUKURLConnectionOperation_ *)op;
+
+- (NSDate *)currentDate_;
+- (BOOL)deferOperationIfPossible_:(MUKURLConnectionOperation_ *)op;
+- (BOOL)isUsingNetwork_;
+- (void)releaseDeferredOperations_;
+- (void)releaseExpiredDeferredOperations_;
+- (NSDate *)deferralExpirationDate_;
+- (void)updateDeferralTimer_;
+- (void)deferralTimerFired_:(NSTimer *)timer;
+
+- (void)scheduleOperations_;
+- (void)insertPendingOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)removePendingOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)insertOperation_:(MUKURLConnectionOperation_ *)op intoPendingOperations_:(NSMutableArray *)operations;
+- (BOOL)removeOperation_:(MUKURLConnectionOperation_ *)op fromPendingOperations_:(NSMutableArray *)operations;
+- (void)admitPendingOperations_;
+- (void)admitOperation_:(MUKURLConnectionOperation_ *)op;
+- (MUKURLConnectionOperation_ *)nextPendingOperation_;
+- (BOOL)hasFreeSlot_;
+- (BOOL)hasSpareSlot_;
+
+- (NSDate *)expirationDateForOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)expireOperation_:(MUKURLConnectionOperation_ *)op;
+- (void)watchDeadlineOfOperation_:(MUKURLConnectionOperation_ *)op;
+- (MUKURLConnectionOperation_ *)firstDeadlineOperationIn_:(NSMutableArray *)operations;
+- (NSDate *)nextExpirationDate_;
+- (void)updateDeadlineTimer_;
+- (void)deadlineTimerFired_:(NSTimer *)timer;
 @end
 
 @implementation MUKURLConnectionQueue
 @synthesize connectionWillStartHandler = connectionWillStartHandler_;
 @synthesize connectionDidFinishHandler = connectionDidFinishHandler_;
+@synthesize connectionsDidFinishHandler = connectionsDidFinishHandler_;
+@synthesize maximumConcurrentConnections = maximumConcurrentConnections_;
+@synthesize minimumTimeToDeadline = minimumTimeToDeadline_;
+@synthesize journal = journal_;
+@synthesize batchEndpointPath = batchEndpointPath_;
+@synthesize batchingInterval = batchingInterval_;
+@synthesize maximumBatchSize = maximumBatchSize_;
+@synthesize shouldBatchConnectionHandler = shouldBatchConnectionHandler_;
+@synthesize prefetchedDataCapacity = prefetchedDataCapacity_;
+@synthesize prefetchedDataLifetime = prefetchedDataLifetime_;
+@synthesize maximumDeferralInterval = maximumDeferralInterval_;
+@synthesize currentDateHandler = currentDateHandler_;
+@synthesize scheduler = scheduler_;
+@synthesize schedulerWeight = schedulerWeight_;
 @synthesize queue_ = queue__;
+@synthesize pendingOperations_ = pendingOperations__;
+@synthesize pendingPrefetchOperations_ = pendingPrefetchOperations__;
+@synthesize admittedOperations_ = admittedOperations__;
+@synthesize nextSequenceNumber_ = nextSequenceNumber__;
+@synthesize deadlineTimer_ = deadlineTimer__;
+@synthesize deadlineOperations_ = deadlineOperations__;
+@synthesize admittedDeadlineOperations_ = admittedDeadlineOperations__;
+@synthesize finishedOperations_ = finishedOperations__;
+@synthesize prefetchOperations_ = prefetchOperations__;
+@synthesize prefetchedResults_ = prefetchedResults__;
+@synthesize prefetchedKeys_ = prefetchedKeys__;
+@synthesize prefetchedDataSize_ = prefetchedDataSize__;
+@synthesize gatheringOperations_ = gatheringOperations__;
+@synthesize operationsByConnection_ = operationsByConnection__;
+@synthesize blockedOperations_ = blockedOperations__;
+@synthesize dependenciesByConnection_ = dependenciesByConnection__;
+@synthesize dependenciesByDependency_ = dependenciesByDependency__;
+@synthesize deferredOperations_ = deferredOperations__;
+@synthesize deferralTimer_ = deferralTimer__;
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        pendingOperations__ = [[NSMutableArray alloc] init];
+        pendingPrefetchOperations__ = [[NSMutableArray alloc] init];
+        admittedOperations__ = [[NSMutableSet alloc] init];
+        deadlineOperations__ = [[NSMutableArray alloc] init];
+        admittedDeadlineOperations__ = [[NSMutableArray alloc] init];
+        finishedOperations__ = [[NSMutableArray alloc] init];
+        prefetchOperations__ = [[NSMutableDictionary alloc] init];
+        prefetchedResults__ = [[NSMutableDictionary alloc] init];
+        prefetchedKeys__ = [[NSMutableArray alloc] init];
+        gatheringOperations__ = [[NSMutableDictionary alloc] init];
+        operationsByConnection__ = [[NSMutableDictionary alloc] init];
+        blockedOperations__ = [[NSMutableSet alloc] init];
+        dependenciesByConnection__ = [[NSMutableDictionary alloc] init];
+        dependenciesByDependency__ = [[NSMutableDictionary alloc] init];
+        deferredOperations__ = [[NSMutableArray alloc] init];
+        batchingInterval_ = 0.05;
+        maximumBatchSize_ = 20;
+        prefetchedDataCapacity_ = 2 * 1024 * 1024;
+        prefetchedDataLifetime_ = 60.0;
+        maximumConcurrentConnections_ = MUKURLConnectionQueueDefaultMaxConcurrentConnections;
+        schedulerWeight_ = 1;
+        
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(didReceiveMemoryWarning_:) name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [deadlineTimer__ invalidate];
+    [deferralTimer__ invalidate];
+}
 
 #pragma mark - Methods
 
@@ -53,7 +241,7 @@ NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections = NSOperati
          */
         [self beginBackgroundTaskIfNeededInOperation_:op];
         /*
-         Add operation
+         Add operation: it will not start until it is admitted
          */
         [self.queue_ addOperation:op];
         inserted = YES;
@@ -62,6 +250,10 @@ NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections = NSOperati
         inserted = NO;
     }
     
+    if (inserted) {
+        [self enqueuePendingOperations_:@[op]];
+    }
+    
     return inserted;
 }
 
@@ -88,15 +280,96 @@ NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections = NSOperati
         inserted = NO;
     }
     
+    if (inserted) {
+        [self enqueuePendingOperations_:operations];
+    }
+    
+    return inserted;
+}
+
+- (NSArray *)addJournaledConnectionsWithConfigurationHandler:(void (^)(MUKURLConnection *))configurationHandler
+{
+    NSArray *connections = [self.journal pendingConnections];
+    
+    if (configurationHandler) {
+        [connections enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop)
+        {
+            configurationHandler(obj);
+        }];
+    }
+    
+    if ([connections count] && ![self addConnections:connections]) {
+        return nil;
+    }
+    
+    return connections;
+}
+
+- (BOOL)addPrefetchRequest:(NSURLRequest *)request {
+    if ([self prefetchKeyForRequest_:request] == nil) {
+        // Only bodyless GET requests can feed connections
+        return NO;
+    }
+    
+    MUKURLConnectionOperation_ *op = [self newPrefetchOperationFromRequest_:request];
+    
+    BOOL inserted;
+    @try {
+        [self.queue_ addOperation:op];
+        inserted = YES;
+    }
+    @catch (NSException *exception) {
+        inserted = NO;
+    }
+    
+    if (inserted) {
+        [self enqueuePendingOperations_:@[op]];
+    }
+    
     return inserted;
 }
 
+- (void)cancelPrefetches {
+    // Running prefetches are cancelled too
+    NSMutableArray *operations = [self.pendingPrefetchOperations_ mutableCopy];
+    [operations addObjectsFromArray:[self.admittedOperations_ allObjects]];
+    
+    // Promoted prefetches are feeding foreground connections
+    for (MUKURLConnectionOperation_ *op in operations) {
+        if ([op isPrefetch] && ![op isPromoted]) {
+            [op cancel];
+        }
+    }
+    
+    [self removeAllPrefetchedResults_];
+}
+
+- (void)addDependency:(MUKURLConnection *)dependency toConnection:(MUKURLConnection *)connection stage:(MUKURLConnectionQueueDependencyStage)stage
+{
+    MUKURLConnectionDependency_ *record = [[MUKURLConnectionDependency_ alloc] initWithConnection:connection dependency:dependency stage:stage receivedBytesCount:0];
+    [self addDependency_:record];
+}
+
+- (void)addDependency:(MUKURLConnection *)dependency toConnection:(MUKURLConnection *)connection receivedBytesCount:(long long)bytesCount
+{
+    MUKURLConnectionDependency_ *record = [[MUKURLConnectionDependency_ alloc] initWithConnection:connection dependency:dependency stage:MUKURLConnectionQueueDependencyStageReceivedBytes receivedBytesCount:bytesCount];
+    [self addDependency_:record];
+}
+
+- (void)releaseDeferredConnections {
+    [self releaseDeferredOperations_];
+    [self scheduleOperations_];
+}
+
 - (NSArray *)connections {
     NSMutableArray *connectionOperations = [NSMutableArray array];
     [[self.queue_ operations] enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
         if ([obj isKindOfClass:[MUKURLConnectionOperation_ class]]) {
             MUKURLConnectionOperation_ *op = obj;
-            [connectionOperations addObject:op.connection];
+            
+            if (![op isPrefetch] && ![op isBatch]) {
+                [connectionOperations addObject:op.connection];
+            }
         }
     }];
     
@@ -129,15 +402,25 @@ NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections = NSOperati
     }
 }
 
-#pragma mark - Accessors
-
-- (NSInteger)maximumConcurrentConnections {
-    return [self.queue_ maxConcurrentOperationCount];
+- (void)didFinishConnections:(NSArray *)connections cancelledConnections:(NSArray *)cancelledConnections
+{
+    if (self.connectionsDidFinishHandler) {
+        self.connectionsDidFinishHandler(connections, cancelledConnections);
+    }
 }
 
+#pragma mark - Accessors
+
 - (void)setMaximumConcurrentConnections:(NSInteger)maximumConcurrentConnections
 {
-    [self.queue_ setMaxConcurrentOperationCount:maximumConcurrentConnections];
+    /*
+     Limit is enforced admitting operations, so underlying queue does not
+     need one (and connections fed by prefetches do not take a slot)
+     */
+    maximumConcurrentConnections_ = maximumConcurrentConnections;
+    [self performOnMainQueue_:^{
+        [self scheduleOperations_];
+    }];
 }
 
 - (NSString *)name {
@@ -153,7 +436,48 @@ NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections = NSOperati
 }
 
 - (void)setSuspended:(BOOL)suspended {
-    [self.queue_ setSuspended:suspended];
+    if (suspended) {
+        // Underlying queue can be suspended from any thread
+        [self.queue_ setSuspended:YES];
+        return;
+    }
+    
+    [self performOnMainQueue_:^{
+        /*
+         Resume before to schedule, so scheduler sees waiting connections and 
+         offers freed slots to most starved queues first
+         */
+        [self.queue_ setSuspended:NO];
+        [self scheduleOperations_];
+    }];
+}
+
+- (void)setScheduler:(MUKURLConnectionScheduler *)scheduler {
+    if (scheduler == scheduler_) {
+        return;
+    }
+    
+    MUKURLConnectionScheduler *oldScheduler = scheduler_;
+    scheduler_ = scheduler;
+    
+    [self performOnMainQueue_:^{
+        [oldScheduler removeQueue:self];
+        [self scheduleOperations_];
+    }];
+}
+
+- (void)setSchedulerWeight:(NSUInteger)schedulerWeight {
+    schedulerWeight_ = schedulerWeight;
+    [self performOnMainQueue_:^{
+        [self scheduleOperations_];
+    }];
+}
+
+- (void)setMinimumTimeToDeadline:(NSTimeInterval)minimumTimeToDeadline {
+    minimumTimeToDeadline_ = minimumTimeToDeadline;
+    [self performOnMainQueue_:^{
+        [self scheduleOperations_];
+    }];
 }
 
 #pragma mark - Private: Accessors
@@ -167,6 +491,16 @@ NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections = NSOperati
 
 #pragma mark - Private
 
+- (void)performOnMainQueue_:(void (^)(void))block {
+    // Scheduling state lives on main queue, like queue callbacks
+    if ([NSThread isMainThread]) {
+        block();
+    }
+    else {
+        dispatch_async(dispatch_get_main_queue(), block);
+    }
+}
+
 - (MUKURLConnectionOperation_ *)newOperationFromConnection_:(MUKURLConnection *)connection
 {
     MUKURLConnectionOperation_ *op = [[MUKURLConnectionOperation_ alloc] initWithConnection:connection];
@@ -184,19 +518,1242 @@ NSInteger const MUKURLConnectionQueueDefaultMaxConcurrentConnections = NSOperati
         strongOp.connectionWillStartHandler = nil;
     };
     
+    op.connectionResponseHandler = ^{
+        [self connectionDidProgressInOperation_:strongOp];
+    };
+    
+    op.connectionProgressHandler = ^{
+        [self.journal recordProgressOfConnection:strongOp.connection];
+        [self connectionDidProgressInOperation_:strongOp];
+    };
+    
     op.completionBlock = ^{
-        dispatch_async(dispatch_get_main_queue(), ^{
-            [self didFinishConnection:strongOp.connection cancelled:[strongOp isCancelled]];
-            [self endBackgroundTaskIfNeededInOperation_:strongOp];
+        // Cycle is broken when batch is drained
+        [self enqueueFinishedOperation_:strongOp];
+    };
+    
+    return op;
+}
+
+- (void)enqueuePendingOperations_:(NSArray *)operations {
+    void (^enqueueBlock)(void) = ^{
+        // Connections enqueued together can depend on each other
+        for (MUKURLConnectionOperation_ *op in operations) {
+            if (![op isPrefetch]) {
+                op.connection.finishedInQueue_ = NO;
+                self.operationsByConnection_[[self keyForConnection_:op.connection]] = op;
+            }
+        }
+        
+        for (MUKURLConnectionOperation_ *op in operations) {
+            // Sort key is captured, so later deadline changes do not break order
+            op.sequenceNumber = self.nextSequenceNumber_++;
+            op.pendingDeadline = op.connection.deadline;
+            
+            if ([op isPrefetch]) {
+                NSString *key = op.prefetchKey;
+                if (self.prefetchOperations_[key] || [self prefetchedResultForKey_:key])
+                {
+                    // Already prefetched: it leaves the queue silently
+                    [op cancel];
+                    continue;
+                }
+                
+                self.prefetchOperations_[key] = op;
+                [self insertPendingOperation_:op];
+                continue;
+            }
+            
+            [self.journal recordConnection:op.connection];
+            [self resolveDependenciesOfEnqueuedOperation_:op];
             
-            // Break cycle
-            strongOp.completionBlock = nil;
+            if ([op isCancelled]) {
+                // It leaves the queue by itself
+                continue;
+            }
+            
+            [self watchDeadlineOfOperation_:op];
+            
+            if ([self deferOperationIfPossible_:op]) {
+                // It will be routed when deferred connections are released
+                continue;
+            }
+            
+            [self routeOperation_:op];
+        }
+        
+        [self releaseExpiredDeferredOperations_];
+        [self scheduleOperations_];
+    };
+    
+    [self performOnMainQueue_:enqueueBlock];
+}
+
+- (void)routeOperation_:(MUKURLConnectionOperation_ *)op {
+    if ([self isBlockedOperation_:op]) {
+        // It is routed again as dependencies are met
+        [self.blockedOperations_ addObject:op];
+        return;
+    }
+    
+    if ([self followPrefetchIfPossible_:op]) {
+        // It does not need a slot
+        return;
+    }
+    
+    if ([self gatherOperationIfPossible_:op]) {
+        // It will be pending when batching window closes
+        return;
+    }
+    
+    [self insertPendingOperation_:op];
+}
+
+- (void)operationDidFinish_:(MUKURLConnectionOperation_ *)op {
+    [self removePendingOperation_:op];
+    [self.admittedOperations_ removeObject:op];
+    [self.blockedOperations_ removeObject:op];
+    
+    if (op.pendingDeadline) {
+        [self removeOperation_:op fromPendingOperations_:self.deadlineOperations_];
+        [self removeOperation_:op fromPendingOperations_:self.admittedDeadlineOperations_];
+    }
+    
+    if ([self.deferredOperations_ count]) {
+        [self.deferredOperations_ removeObject:op];
+        [self updateDeferralTimer_];
+    }
+}
+
+- (void)enqueueFinishedOperation_:(MUKURLConnectionOperation_ *)op {
+    // Called on operation thread
+    BOOL drainNeeded;
+    @synchronized(self.finishedOperations_) {
+        drainNeeded = ([self.finishedOperations_ count] == 0);
+        [self.finishedOperations_ addObject:op];
+    }
+    
+    // Only first operation of a batch wakes main queue up
+    if (drainNeeded) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self drainFinishedOperations_];
         });
+    }
+}
+
+- (void)drainFinishedOperations_ {
+    NSArray *operations;
+    @synchronized(self.finishedOperations_) {
+        operations = [self.finishedOperations_ copy];
+        [self.finishedOperations_ removeAllObjects];
+    }
+    
+    NSMutableArray *connections = [[NSMutableArray alloc] initWithCapacity:[operations count]];
+    NSMutableArray *cancelledConnections = [[NSMutableArray alloc] init];
+    
+    for (MUKURLConnectionOperation_ *op in operations) {
+        BOOL cancelled = [op isCancelled];
+        
+        [self operationDidFinish_:op];
+        
+        if ([op isPrefetch]) {
+            // Not visible through callbacks
+            [self prefetchOperationDidFinish_:op];
+            continue;
+        }
+        
+        if ([op isBatch]) {
+            // Not visible through callbacks
+            [self batchOperationDidFinish_:op];
+            continue;
+        }
+        
+        op.connection.finishedInQueue_ = YES;
+        op.connection.succeededInQueue_ = (!cancelled && [op isSucceeded]);
+        [self.operationsByConnection_ removeObjectForKey:[self keyForConnection_:op.connection]];
+        
+        [self resolveDependenciesOfFinishedOperation_:op];
+        [self.journal recordCompletionOfConnection:op.connection];
+        [self didFinishConnection:op.connection cancelled:cancelled];
+        [self endBackgroundTaskIfNeededInOperation_:op];
+        
+        // Break cycle
+        op.connectionStartHandler = nil;
+        op.connectionResponseHandler = nil;
+        op.connectionProgressHandler = nil;
+        op.completionBlock = nil;
+        
+        [connections addObject:op.connection];
+        if (cancelled) {
+            [cancelledConnections addObject:op.connection];
+        }
+    }
+    
+    if ([connections count]) {
+        [self didFinishConnections:connections cancelledConnections:cancelledConnections];
+    }
+    
+    // Give freed slots to other connections
+    [self scheduleOperations_];
+}
+
+#pragma mark - Private: Prefetch
+
+- (NSString *)prefetchKeyForRequest_:(NSURLRequest *)request {
+    NSURL *URL = [request URL];
+    NSString *method = ([request HTTPMethod] ?: @"GET");
+    
+    if (URL == nil || ![method isEqualToString:@"GET"] ||
+        [request HTTPBody] || [request HTTPBodyStream])
+    {
+        return nil;
+    }
+    
+    /*
+     Header fields could change response (e.g. Authorization, Range, Accept),
+     so they are matched too
+     */
+    NSMutableString *key = [NSMutableString stringWithFormat:@"%@ %@", method, [URL absoluteString]];
+    NSDictionary *headerFields = [request allHTTPHeaderFields];
+    NSArray *names = [[headerFields allKeys] sortedArrayUsingSelector:@selector(caseInsensitiveCompare:)];
+    
+    for (NSString *name in names) {
+        [key appendFormat:@"\n%@: %@", [name lowercaseString], headerFields[name]];
+    }
+    
+    return key;
+}
+
+- (MUKURLConnectionOperation_ *)newPrefetchOperationFromRequest_:(NSURLRequest *)request
+{
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:request];
+    connection.usesBuffer = YES;
+    
+    NSString *key = [self prefetchKeyForRequest_:request];
+    
+    MUKURLConnectionOperation_ *op = [self newOperationFromConnection_:connection];
+    op.prefetch = YES;
+    op.prefetchKey = key;
+    op.connectionWillStartHandler = nil;
+    
+    /*
+     Prefetch connection feeds connections which follow it. 
+     Don't keep strong pointers: operation owns connection.
+     */
+    __weak MUKURLConnectionQueue *weakSelf = self;
+    __weak MUKURLConnectionOperation_ *weakOp = op;
+    
+    connection.responseHandler = ^(NSURLResponse *response) {
+        for (MUKURLConnectionOperation_ *followerOp in [weakOp.followerOperations copy])
+        {
+            if (![followerOp isCancelled]) {
+                [followerOp.connection didReceiveResponse:response];
+            }
+        }
+    };
+    
+    connection.progressHandler = ^(NSData *chunk, float quota) {
+        for (MUKURLConnectionOperation_ *followerOp in [weakOp.followerOperations copy])
+        {
+            if (![followerOp isCancelled]) {
+                [followerOp.connection didReceiveData:chunk];
+            }
+        }
+    };
+    
+    connection.completionHandler = ^(BOOL success, NSError *error) {
+        MUKURLConnectionOperation_ *strongOp = weakOp;
+        NSArray *followerOperations = strongOp.followerOperations;
+        strongOp.followerOperations = nil;
+        
+        if (success && [followerOperations count] == 0 && strongOp.response) {
+            // Keep data until someone asks for it (or it is too old, or memory is low)
+            [weakSelf storePrefetchedResponse_:strongOp.response data:[strongOp.connection bufferedData] forKey:key];
+        }
+        
+        for (MUKURLConnectionOperation_ *followerOp in followerOperations) {
+            if ([followerOp isCancelled]) {
+                continue;
+            }
+            
+            if (success) {
+                [followerOp.connection didFinishLoading];
+            }
+            else {
+                [followerOp.connection didFailWithError:error];
+            }
+        }
     };
     
     return op;
 }
 
+- (BOOL)followPrefetchIfPossible_:(MUKURLConnectionOperation_ *)op {
+    NSString *key = [self prefetchKeyForRequest_:op.connection.request];
+    if (key == nil) {
+        return NO;
+    }
+    
+    MUKURLConnectionOperation_ *prefetchOp = self.prefetchOperations_[key];
+    if ([self prefetchedResultForKey_:key] == nil &&
+        (prefetchOp == nil || [prefetchOp isCancelled] || [prefetchOp isFinished]))
+    {
+        return NO;
+    }
+    
+    // Promote in place: prefetch is no more speculative
+    if (prefetchOp) {
+        [self promotePrefetchOperation_:prefetchOp];
+    }
+    
+    MUKURLConnectionOperation_ *strongOp = op;
+    op.prefetchKey = key;
+    op.follower = YES;
+    op.connectionStartHandler = ^{
+        [self startFollowerOperation_:strongOp];
+    };
+    [self admitOperation_:op];
+    
+    return YES;
+}
+
+- (void)startFollowerOperation_:(MUKURLConnectionOperation_ *)op {
+    NSString *key = op.prefetchKey;
+    
+    // Already downloaded: replay it
+    NSDictionary *result = [self prefetchedResultForKey_:key];
+    if (result) {
+        [self removePrefetchedResultForKey_:key];
+        
+        [self feedConnection_:op.connection withResponse:result[kPrefetchedResponseKey] data:result[kPrefetchedDataKey]];
+        return;
+    }
+    
+    MUKURLConnectionOperation_ *prefetchOp = self.prefetchOperations_[key];
+    if (prefetchOp == nil || [prefetchOp isCancelled] || [prefetchOp isFinished])
+    {
+        // Prefetch is gone: go to network
+        [op.connection start];
+        return;
+    }
+    
+    // Catch up with prefetch, then follow it
+    if (prefetchOp.followerOperations == nil) {
+        prefetchOp.followerOperations = [[NSMutableArray alloc] init];
+    }
+    [prefetchOp.followerOperations addObject:op];
+    [self promotePrefetchOperation_:prefetchOp];
+    
+    if (prefetchOp.response) {
+        NSData *data = [prefetchOp.connection bufferedData];
+        [op.connection didReceiveResponse:prefetchOp.response];
+        if ([data length]) {
+            [op.connection didReceiveData:data];
+        }
+    }
+}
+
+- (void)promotePrefetchOperation_:(MUKURLConnectionOperation_ *)op {
+    if ([op isPromoted]) {
+        return;
+    }
+    
+    // A pending prefetch moves to foreground lane
+    BOOL pending = [self removeOperation_:op fromPendingOperations_:self.pendingPrefetchOperations_];
+    op.promoted = YES;
+    
+    if (pending) {
+        [self insertPendingOperation_:op];
+    }
+}
+
+- (void)prefetchOperationDidFinish_:(MUKURLConnectionOperation_ *)op {
+    NSString *key = op.prefetchKey;
+    if (self.prefetchOperations_[key] == op) {
+        [self.prefetchOperations_ removeObjectForKey:key];
+    }
+    
+    // Prefetch ended without feeding its followers (e.g. cancelled)
+    for (MUKURLConnectionOperation_ *followerOp in op.followerOperations) {
+        if (![followerOp isCancelled] && ![followerOp isFinished]) {
+            [followerOp.connection start];
+        }
+    }
+    op.followerOperations = nil;
+    
+    // Break cycle
+    op.connectionResponseHandler = nil;
+    op.connectionProgressHandler = nil;
+    op.completionBlock = nil;
+}
+
+- (void)didReceiveMemoryWarning_:(NSNotification *)notification {
+    [self cancelPrefetches];
+}
+
+- (void)feedConnection_:(MUKURLConnection *)connection withResponse:(NSURLResponse *)response data:(NSData *)data
+{
+    // Replay a whole transfer, like it was coming from network
+    [connection didReceiveResponse:response];
+    if ([data length]) {
+        [connection didReceiveData:data];
+    }
+    [connection didFinishLoading];
+}
+
+- (NSDictionary *)prefetchedResultForKey_:(NSString *)key {
+    // Stale data is never fed
+    [self removeExpiredPrefetchedResults_];
+    return self.prefetchedResults_[key];
+}
+
+- (void)removeExpiredPrefetchedResults_ {
+    // Results are stored in order, so expired ones are the oldest
+    NSDate *now = [NSDate date];
+    while ([self.prefetchedKeys_ count]) {
+        NSString *oldestKey = self.prefetchedKeys_[0];
+        NSDate *date = self.prefetchedResults_[oldestKey][kPrefetchedDateKey];
+        
+        if ([now timeIntervalSinceDate:date] < self.prefetchedDataLifetime) {
+            break;
+        }
+        
+        [self removePrefetchedResultForKey_:oldestKey];
+    }
+}
+
+- (void)storePrefetchedResponse_:(NSURLResponse *)response data:(NSData *)data forKey:(NSString *)key
+{
+    [self removeExpiredPrefetchedResults_];
+    [self removePrefetchedResultForKey_:key];
+    
+    if ([data length] > self.prefetchedDataCapacity) {
+        // It would evict every other result
+        return;
+    }
+    
+    self.prefetchedResults_[key] = @{ kPrefetchedResponseKey : response, kPrefetchedDataKey : (data ?: [NSData data]), kPrefetchedDateKey : [NSDate date] };
+    [self.prefetchedKeys_ addObject:key];
+    self.prefetchedDataSize_ += [data length];
+    
+    // Least recently stored results go first (used ones are already gone)
+    while (self.prefetchedDataSize_ > self.prefetchedDataCapacity) {
+        [self removePrefetchedResultForKey_:self.prefetchedKeys_[0]];
+    }
+}
+
+- (void)removePrefetchedResultForKey_:(NSString *)key {
+    NSDictionary *result = self.prefetchedResults_[key];
+    if (result == nil) {
+        return;
+    }
+    
+    self.prefetchedDataSize_ -= [result[kPrefetchedDataKey] length];
+    [self.prefetchedResults_ removeObjectForKey:key];
+    [self.prefetchedKeys_ removeObject:key];
+}
+
+- (void)removeAllPrefetchedResults_ {
+    [self.prefetchedResults_ removeAllObjects];
+    [self.prefetchedKeys_ removeAllObjects];
+    self.prefetchedDataSize_ = 0;
+}
+
+#pragma mark - Private: Batching
+
+- (NSString *)batchKeyForOperation_:(MUKURLConnectionOperation_ *)op {
+    if (self.batchEndpointPath == nil || self.maximumBatchSize < 2) {
+        return nil;
+    }
+    
+    NSURLRequest *request = op.connection.request;
+    NSURL *URL = [request URL];
+    NSString *scheme = [[URL scheme] lowercaseString];
+    
+    if ([URL host] == nil ||
+        !([scheme isEqualToString:@"http"] || [scheme isEqualToString:@"https"]))
+    {
+        return nil;
+    }
+    
+    if ([request HTTPBodyStream]) {
+        // Stream can not be copied into a part, whatever handler says
+        return nil;
+    }
+    
+    if (self.shouldBatchConnectionHandler) {
+        if (!self.shouldBatchConnectionHandler(op.connection)) {
+            return nil;
+        }
+    }
+    else if (![[request HTTPMethod] isEqualToString:@"GET"] || [request HTTPBody])
+    {
+        // Only bodyless requests are small enough by default
+        return nil;
+    }
+    
+    // One batch per origin
+    NSNumber *port = [URL port];
+    return [NSString stringWithFormat:@"%@://%@:%@", scheme, [[URL host] lowercaseString], (port ?: @"")];
+}
+
+- (BOOL)gatherOperationIfPossible_:(MUKURLConnectionOperation_ *)op {
+    NSString *key = [self batchKeyForOperation_:op];
+    if (key == nil) {
+        return NO;
+    }
+    
+    NSMutableArray *operations = self.gatheringOperations_[key];
+    if (operations == nil) {
+        operations = [[NSMutableArray alloc] init];
+        self.gatheringOperations_[key] = operations;
+        
+        // First operation opens batching window
+        dispatch_time_t popTime = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.batchingInterval * NSEC_PER_SEC));
+        dispatch_after(popTime, dispatch_get_main_queue(), ^{
+            // Window could have been closed by a full batch
+            if (self.gatheringOperations_[key] == operations) {
+                [self flushGatheredOperationsForKey_:key];
+                [self scheduleOperations_];
+            }
+        });
+    }
+    
+    [operations addObject:op];
+    
+    if ([operations count] >= self.maximumBatchSize) {
+        [self flushGatheredOperationsForKey_:key];
+    }
+    
+    return YES;
+}
+
+- (void)flushGatheredOperationsForKey_:(NSString *)key {
+    NSArray *operations = self.gatheringOperations_[key];
+    [self.gatheringOperations_ removeObjectForKey:key];
+    
+    // Cancelled operations are already ready to leave the queue
+    NSIndexSet *indexes = [operations indexesOfObjectsPassingTest:^BOOL(id obj, NSUInteger idx, BOOL *stop)
+    {
+        return ![obj isCancelled];
+    }];
+    operations = [operations objectsAtIndexes:indexes];
+    
+    if ([operations count] < 2) {
+        // Nothing to share a round trip with
+        for (MUKURLConnectionOperation_ *op in operations) {
+            [self insertPendingOperation_:op];
+        }
+        return;
+    }
+    
+    MUKURLConnectionOperation_ *batchOp = [self newBatchOperationFromOperations_:operations];
+    
+    BOOL inserted;
+    @try {
+        [self.queue_ addOperation:batchOp];
+        inserted = YES;
+    }
+    @catch (NSException *exception) {
+        inserted = NO;
+    }
+    
+    if (!inserted) {
+        for (MUKURLConnectionOperation_ *op in operations) {
+            [self insertPendingOperation_:op];
+        }
+        return;
+    }
+    
+    // Batch takes first member's place
+    batchOp.sequenceNumber = [operations[0] sequenceNumber];
+    [self watchDeadlineOfOperation_:batchOp];
+    [self insertPendingOperation_:batchOp];
+    
+    for (MUKURLConnectionOperation_ *op in operations) {
+        MUKURLConnectionOperation_ *strongOp = op;
+        op.follower = YES;
+        op.batchOperation = batchOp;
+        op.connectionStartHandler = ^{
+            [self startBatchedOperation_:strongOp];
+        };
+        [self admitOperation_:op];
+    }
+}
+
+- (MUKURLConnectionOperation_ *)newBatchOperationFromOperations_:(NSArray *)operations
+{
+    NSMutableArray *requests = [[NSMutableArray alloc] initWithCapacity:[operations count]];
+    NSDate *deadline = nil;
+    
+    for (MUKURLConnectionOperation_ *op in operations) {
+        [requests addObject:op.connection.request];
+        
+        NSDate *memberDeadline = op.connection.deadline;
+        if (memberDeadline && (deadline == nil || [memberDeadline compare:deadline] == NSOrderedAscending))
+        {
+            deadline = memberDeadline;
+        }
+    }
+    
+    NSURLRequest *firstRequest = requests[0];
+    NSURL *endpointURL = [[NSURL URLWithString:self.batchEndpointPath relativeToURL:[firstRequest URL]] absoluteURL];
+    NSURLRequest *batchRequest = [MUKURLConnectionBatch_ newBatchRequestWithRequests:requests endpointURL:endpointURL];
+    
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:batchRequest];
+    connection.usesBuffer = YES;
+    // Most urgent member decides batch priority
+    connection.deadline = deadline;
+    
+    MUKURLConnectionOperation_ *op = [self newOperationFromConnection_:connection];
+    op.batch = YES;
+    op.pendingDeadline = deadline;
+    op.connectionWillStartHandler = nil;
+    op.connectionResponseHandler = nil;
+    op.connectionProgressHandler = nil;
+    op.followerOperations = [operations mutableCopy];
+    
+    // Operation owns connection
+    __weak MUKURLConnectionOperation_ *weakOp = op;
+    
+    connection.completionHandler = ^(BOOL success, NSError *error) {
+        // Members which get no part go to network when batch leaves the queue
+        if (!success) {
+            return;
+        }
+        
+        MUKURLConnectionOperation_ *strongOp = weakOp;
+        NSArray *results = [MUKURLConnectionBatch_ resultsWithRequests:requests batchResponse:strongOp.response data:[strongOp.connection bufferedData]];
+        
+        [results enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop)
+        {
+            MUKURLConnectionOperation_ *memberOp = strongOp.followerOperations[idx];
+            if (obj == [NSNull null] || [memberOp isCancelled] || [memberOp isFinished])
+            {
+                return;
+            }
+            
+            if ([memberOp isExecuting]) {
+                [self feedConnection_:memberOp.connection withResponse:obj[MUKURLConnectionBatchResponseKey] data:obj[MUKURLConnectionBatchDataKey]];
+            }
+            else {
+                // Delivered as member is started
+                memberOp.batchResult = obj;
+            }
+        }];
+    };
+    
+    return op;
+}
+
+- (void)startBatchedOperation_:(MUKURLConnectionOperation_ *)op {
+    NSDictionary *result = op.batchResult;
+    if (result) {
+        op.batchResult = nil;
+        [self feedConnection_:op.connection withResponse:result[MUKURLConnectionBatchResponseKey] data:result[MUKURLConnectionBatchDataKey]];
+        return;
+    }
+    
+    if ([self.admittedOperations_ containsObject:op]) {
+        // Batch is gone without a part and connection has got its own slot
+        [op.connection start];
+    }
+    
+    // Otherwise it is fed when batch reply arrives, or started when admitted
+}
+
+- (void)batchOperationDidFinish_:(MUKURLConnectionOperation_ *)op {
+    /*
+     Members which have not been fed perform their own transfer, so they wait 
+     for a slot like other connections
+     */
+    for (MUKURLConnectionOperation_ *memberOp in op.followerOperations) {
+        if ([memberOp isCancelled] || [memberOp isFinished] || memberOp.batchResult)
+        {
+            continue;
+        }
+        
+        memberOp.follower = NO;
+        [self insertPendingOperation_:memberOp];
+    }
+    op.followerOperations = nil;
+    
+    // Break cycle
+    op.connection.completionHandler = nil;
+    op.completionBlock = nil;
+}
+
+#pragma mark - Private: Dependencies
+
+- (id)keyForConnection_:(MUKURLConnection *)connection {
+    // Connections are not copyable: they are indexed by pointer
+    return [NSValue valueWithNonretainedObject:connection];
+}
+
+- (void)addDependency_:(MUKURLConnectionDependency_ *)dependency {
+    if (dependency.connection == nil || dependency.dependency == nil ||
+        dependency.connection == dependency.dependency)
+    {
+        return;
+    }
+    
+    if (self.operationsByConnection_[[self keyForConnection_:dependency.connection]])
+    {
+        // Connection is already enqueued: it can not be held anymore
+        return;
+    }
+    
+    // Records retain connections, so keys stay valid
+    id connectionKey = [self keyForConnection_:dependency.connection];
+    id dependencyKey = [self keyForConnection_:dependency.dependency];
+    
+    if (self.dependenciesByConnection_[connectionKey] == nil) {
+        self.dependenciesByConnection_[connectionKey] = [[NSMutableArray alloc] init];
+    }
+    [self.dependenciesByConnection_[connectionKey] addObject:dependency];
+    
+    if (self.dependenciesByDependency_[dependencyKey] == nil) {
+        self.dependenciesByDependency_[dependencyKey] = [[NSMutableArray alloc] init];
+    }
+    [self.dependenciesByDependency_[dependencyKey] addObject:dependency];
+}
+
+- (void)removeDependency_:(MUKURLConnectionDependency_ *)dependency {
+    id connectionKey = [self keyForConnection_:dependency.connection];
+    id dependencyKey = [self keyForConnection_:dependency.dependency];
+    
+    NSMutableArray *dependencies = self.dependenciesByConnection_[connectionKey];
+    [dependencies removeObjectIdenticalTo:dependency];
+    if (dependencies && [dependencies count] == 0) {
+        [self.dependenciesByConnection_ removeObjectForKey:connectionKey];
+    }
+    
+    dependencies = self.dependenciesByDependency_[dependencyKey];
+    [dependencies removeObjectIdenticalTo:dependency];
+    if (dependencies && [dependencies count] == 0) {
+        [self.dependenciesByDependency_ removeObjectForKey:dependencyKey];
+    }
+}
+
+- (BOOL)isBlockedOperation_:(MUKURLConnectionOperation_ *)op {
+    NSArray *dependencies = self.dependenciesByConnection_[[self keyForConnection_:op.connection]];
+    
+    for (MUKURLConnectionDependency_ *dependency in dependencies) {
+        if (![dependency isSatisfied]) {
+            return YES;
+        }
+    }
+    
+    return NO;
+}
+
+- (void)routeOperationIfUnblocked_:(MUKURLConnectionOperation_ *)op {
+    if (op && [self.blockedOperations_ containsObject:op] && ![self isBlockedOperation_:op])
+    {
+        [self.blockedOperations_ removeObject:op];
+        [self routeOperation_:op];
+    }
+}
+
+- (void)resolveDependenciesOfEnqueuedOperation_:(MUKURLConnectionOperation_ *)op
+{
+    NSArray *dependencies = [self.dependenciesByConnection_[[self keyForConnection_:op.connection]] copy];
+    BOOL cancelled = NO;
+    
+    for (MUKURLConnectionDependency_ *dependency in dependencies) {
+        if ([dependency isSatisfied]) {
+            continue;
+        }
+        
+        MUKURLConnectionOperation_ *dependencyOp = self.operationsByConnection_[[self keyForConnection_:dependency.dependency]];
+        if (dependencyOp) {
+            // Dependency could be past stage already
+            if ([dependency isSatisfiedByDependencyWithResponse:(dependencyOp.response != nil)])
+            {
+                dependency.satisfied = YES;
+            }
+            continue;
+        }
+        
+        /*
+         Dependency is not in the queue: if it has already left it, its outcome 
+         decides; if it has never been enqueued, dependency is ignored
+         */
+        [self removeDependency_:dependency];
+        
+        if ([dependency.dependency isFinishedInQueue_] &&
+            ![dependency.dependency isSucceededInQueue_])
+        {
+            cancelled = YES;
+        }
+    }
+    
+    if (cancelled) {
+        [op cancel];
+    }
+}
+
+- (void)connectionDidProgressInOperation_:(MUKURLConnectionOperation_ *)op {
+    NSArray *dependencies = [self.dependenciesByDependency_[[self keyForConnection_:op.connection]] copy];
+    BOOL satisfied = NO;
+    
+    for (MUKURLConnectionDependency_ *dependency in dependencies) {
+        if (![dependency isSatisfied] &&
+            [dependency isSatisfiedByDependencyWithResponse:(op.response != nil)])
+        {
+            dependency.satisfied = YES;
+            satisfied = YES;
+            
+            [self routeOperationIfUnblocked_:self.operationsByConnection_[[self keyForConnection_:dependency.connection]]];
+        }
+    }
+    
+    // Start dependents while dependency is still transferring
+    if (satisfied) {
+        [self scheduleOperations_];
+    }
+}
+
+- (void)resolveDependenciesOfFinishedOperation_:(MUKURLConnectionOperation_ *)op
+{
+    BOOL cancelled = [op isCancelled];
+    BOOL succeeded = (!cancelled && [op isSucceeded]);
+    id key = [self keyForConnection_:op.connection];
+    
+    // Dependent connection has left the queue
+    for (MUKURLConnectionDependency_ *dependency in [self.dependenciesByConnection_[key] copy])
+    {
+        [self removeDependency_:dependency];
+    }
+    
+    NSMutableArray *connectionsToCancel = [[NSMutableArray alloc] init];
+    
+    for (MUKURLConnectionDependency_ *dependency in [self.dependenciesByDependency_[key] copy])
+    {
+        [self removeDependency_:dependency];
+        
+        // Cancellation goes down the graph, failure only where it blocks
+        if (cancelled || (!succeeded && ![dependency isSatisfied])) {
+            [connectionsToCancel addObject:dependency.connection];
+        }
+        else {
+            [self routeOperationIfUnblocked_:self.operationsByConnection_[[self keyForConnection_:dependency.connection]]];
+        }
+    }
+    
+    // Cancelled dependents resolve their own dependents as they finish
+    for (MUKURLConnection *connection in connectionsToCancel) {
+        [connection cancel];
+    }
+}
+
+#pragma mark - Private: Deferral
+
+- (NSDate *)currentDate_ {
+    if (self.currentDateHandler) {
+        return self.currentDateHandler();
+    }
+    
+    return [NSDate date];
+}
+
+- (BOOL)deferOperationIfPossible_:(MUKURLConnectionOperation_ *)op {
+    if (![op.connection isDeferrable] || self.maximumDeferralInterval <= 0.0) {
+        return NO;
+    }
+    
+    // Window is closed by oldest deferred connection, or it is opened now
+    NSDate *now = [self currentDate_];
+    NSDate *releaseDate = ([self deferralExpirationDate_] ?: [now dateByAddingTimeInterval:self.maximumDeferralInterval]);
+    
+    /*
+     Window is measured with queue clock, while deadlines are wall clock dates:
+     compare time left instead of dates
+     */
+    NSDate *expirationDate = [self expirationDateForOperation_:op];
+    if (expirationDate && [expirationDate timeIntervalSinceNow] < [releaseDate timeIntervalSinceDate:now])
+    {
+        // It would expire while held
+        return NO;
+    }
+    
+    op.deferralDate = now;
+    [self.deferredOperations_ addObject:op];
+    [self updateDeferralTimer_];
+    
+    return YES;
+}
+
+- (BOOL)isUsingNetwork_ {
+    for (MUKURLConnectionOperation_ *op in self.admittedOperations_) {
+        if ([op isCancelled] || [op.connection isDeferrable]) {
+            continue;
+        }
+        
+        if ([op isPrefetch] && ![op isPromoted]) {
+            continue;
+        }
+        
+        return YES;
+    }
+    
+    return NO;
+}
+
+- (void)releaseDeferredOperations_ {
+    if ([self.deferredOperations_ count] == 0) {
+        return;
+    }
+    
+    // Burst: every deferred connection goes together
+    NSArray *operations = [self.deferredOperations_ copy];
+    [self.deferredOperations_ removeAllObjects];
+    
+    for (MUKURLConnectionOperation_ *op in operations) {
+        if (![op isCancelled]) {
+            [self routeOperation_:op];
+        }
+    }
+    
+    [self updateDeferralTimer_];
+}
+
+- (void)releaseExpiredDeferredOperations_ {
+    NSDate *expirationDate = [self deferralExpirationDate_];
+    if (expirationDate && [expirationDate compare:[self currentDate_]] != NSOrderedDescending)
+    {
+        [self releaseDeferredOperations_];
+    }
+}
+
+- (NSDate *)deferralExpirationDate_ {
+    // Oldest deferred connection closes the window for everyone
+    NSDate *deferralDate = nil;
+    for (MUKURLConnectionOperation_ *op in self.deferredOperations_) {
+        if (deferralDate == nil || [op.deferralDate compare:deferralDate] == NSOrderedAscending)
+        {
+            deferralDate = op.deferralDate;
+        }
+    }
+    
+    return [deferralDate dateByAddingTimeInterval:self.maximumDeferralInterval];
+}
+
+- (void)updateDeferralTimer_ {
+    [self.deferralTimer_ invalidate];
+    self.deferralTimer_ = nil;
+    
+    NSDate *expirationDate = [self deferralExpirationDate_];
+    if (expirationDate == nil) {
+        return;
+    }
+    
+    // Window is measured with queue clock
+    NSTimeInterval interval = MAX([expirationDate timeIntervalSinceDate:[self currentDate_]], 0.0);
+    self.deferralTimer_ = [[NSTimer alloc] initWithFireDate:[NSDate dateWithTimeIntervalSinceNow:interval] interval:0.0 target:self selector:@selector(deferralTimerFired_:) userInfo:nil repeats:NO];
+    [[NSRunLoop mainRunLoop] addTimer:self.deferralTimer_ forMode:NSRunLoopCommonModes];
+}
+
+- (void)deferralTimerFired_:(NSTimer *)timer {
+    self.deferralTimer_ = nil;
+    
+    [self releaseExpiredDeferredOperations_];
+    [self updateDeferralTimer_];
+    [self scheduleOperations_];
+}
+
+#pragma mark - Private: Scheduling
+
+- (void)scheduleOperations_ {
+    if (self.scheduler) {
+        // Slots are shared: every queue of scheduler has its chance
+        [self.scheduler updateQueue:self];
+        [self.scheduler scheduleQueues];
+    }
+    else {
+        [self admitScheduledOperations_];
+    }
+}
+
+- (void)admitPendingOperations_ {
+    while (([self.pendingOperations_ count] || [self.pendingPrefetchOperations_ count]) &&
+           [self hasFreeSlot_])
+    {
+        MUKURLConnectionOperation_ *op = [self nextPendingOperation_];
+        [self removePendingOperation_:op];
+        
+        if ([op isCancelled]) {
+            // Already ready to leave the queue
+            continue;
+        }
+        
+        NSDate *expirationDate = [self expirationDateForOperation_:op];
+        if (expirationDate && [expirationDate timeIntervalSinceNow] <= 0.0) {
+            // It can not meet its deadline: don't waste a slot
+            [self expireOperation_:op];
+            continue;
+        }
+        
+        BOOL speculative = ([op isPrefetch] && ![op isPromoted]);
+        if (speculative && ![self hasSpareSlot_]) {
+            // Prefetches never compete with other connections
+            [self insertPendingOperation_:op];
+            break;
+        }
+        
+        if (self.scheduler && ![self.scheduler canAdmitConnectionInQueue:self speculative:speculative])
+        {
+            // Global budget is spent
+            [self insertPendingOperation_:op];
+            break;
+        }
+        
+        [self.admittedOperations_ addObject:op];
+        [self admitOperation_:op];
+        
+        if ([op isExecuting] && ![op.connection isActive]) {
+            // Member of a failed batch: operation is already running
+            [op.connection start];
+        }
+    }
+    
+    // Radio is up: deferred connections ride along
+    if ([self.deferredOperations_ count] && [self isUsingNetwork_]) {
+        [self releaseDeferredOperations_];
+        [self admitPendingOperations_];
+        return;
+    }
+    
+    [self updateDeadlineTimer_];
+}
+
+- (void)admitOperation_:(MUKURLConnectionOperation_ *)op {
+    // An admitted connection does not need time to be started anymore
+    if (op.pendingDeadline && ![op isAdmitted] &&
+        [self removeOperation_:op fromPendingOperations_:self.deadlineOperations_])
+    {
+        [self insertOperation_:op intoPendingOperations_:self.admittedDeadlineOperations_];
+    }
+    
+    op.admitted = YES;
+}
+
+- (void)insertPendingOperation_:(MUKURLConnectionOperation_ *)op {
+    // Prefetches wait in their own lane, so they never hide connections
+    NSMutableArray *operations = (([op isPrefetch] && ![op isPromoted]) ? self.pendingPrefetchOperations_ : self.pendingOperations_);
+    [self insertOperation_:op intoPendingOperations_:operations];
+}
+
+- (void)removePendingOperation_:(MUKURLConnectionOperation_ *)op {
+    if ([op isPrefetch] && ![op isPromoted]) {
+        [self removeOperation_:op fromPendingOperations_:self.pendingPrefetchOperations_];
+    }
+    else {
+        [self removeOperation_:op fromPendingOperations_:self.pendingOperations_];
+    }
+}
+
+- (void)insertOperation_:(MUKURLConnectionOperation_ *)op intoPendingOperations_:(NSMutableArray *)operations
+{
+    NSUInteger index = [operations indexOfObject:op inSortedRange:NSMakeRange(0, [operations count]) options:(NSBinarySearchingInsertionIndex|NSBinarySearchingLastEqual) usingComparator:^NSComparisonResult(id obj1, id obj2)
+    {
+        return ComparePendingOperations_(obj1, obj2);
+    }];
+    
+    [operations insertObject:op atIndex:index];
+}
+
+- (BOOL)removeOperation_:(MUKURLConnectionOperation_ *)op fromPendingOperations_:(NSMutableArray *)operations
+{
+    NSUInteger count = [operations count];
+    if (count == 0) {
+        return NO;
+    }
+    
+    NSUInteger index = [operations indexOfObject:op inSortedRange:NSMakeRange(0, count) options:NSBinarySearchingFirstEqual usingComparator:^NSComparisonResult(id obj1, id obj2)
+    {
+        return ComparePendingOperations_(obj1, obj2);
+    }];
+    
+    // A batch shares sort key with its first member
+    for (; index < count && ComparePendingOperations_(operations[index], op) == NSOrderedSame; index++)
+    {
+        if (operations[index] == op) {
+            [operations removeObjectAtIndex:index];
+            return YES;
+        }
+    }
+    
+    return NO;
+}
+
+- (MUKURLConnectionOperation_ *)nextPendingOperation_ {
+    // Pending operations are sorted and blocked ones wait apart
+    if ([self.pendingOperations_ count]) {
+        return self.pendingOperations_[0];
+    }
+    
+    // Prefetches only take spare capacity, in FIFO order
+    if ([self.pendingPrefetchOperations_ count]) {
+        return self.pendingPrefetchOperations_[0];
+    }
+    
+    return nil;
+}
+
+- (BOOL)hasFreeSlot_ {
+    NSInteger maxCount = self.maximumConcurrentConnections;
+    if (maxCount == MUKURLConnectionQueueDefaultMaxConcurrentConnections) {
+        // Underlying queue decides
+        return YES;
+    }
+    
+    return ((NSInteger)[self.admittedOperations_ count] < maxCount);
+}
+
+- (BOOL)hasSpareSlot_ {
+    if ([self.gatheringOperations_ count]) {
+        // Gathered connections are about to become pending
+        return NO;
+    }
+    
+    if (self.maximumConcurrentConnections == MUKURLConnectionQueueDefaultMaxConcurrentConnections)
+    {
+        // No limit to measure spare capacity with: only an idle queue has it
+        return ([self.admittedOperations_ count] == 0);
+    }
+    
+    return [self hasFreeSlot_];
+}
+
+#pragma mark - Private: Scheduler
+
+- (NSUInteger)scheduledConnectionsCount_ {
+    return [self.admittedOperations_ count];
+}
+
+- (BOOL)hasWaitingConnections_ {
+    if ([self isSuspended]) {
+        return NO;
+    }
+    
+    /*
+     Pending lane is kept up to date as connections are enqueued, unblocked and
+     admitted: it only contains foreground connections which could start now
+     */
+    return ([self.pendingOperations_ count] > 0);
+}
+
+- (BOOL)isBusy_ {
+    return ([self.pendingOperations_ count] || [self.pendingPrefetchOperations_ count] ||
+            [self.blockedOperations_ count] || [self.admittedOperations_ count] ||
+            [self.deferredOperations_ count] || [self.gatheringOperations_ count]);
+}
+
+- (void)admitScheduledOperations_ {
+    // Don't fill slots while suspended: more urgent connections could come
+    if (![self isSuspended]) {
+        [self admitPendingOperations_];
+    }
+    else {
+        [self updateDeadlineTimer_];
+    }
+}
+
+#pragma mark - Private: Deadlines
+
+- (NSDate *)expirationDateForOperation_:(MUKURLConnectionOperation_ *)op {
+    // Deadline is watched as it was when connection has been enqueued
+    NSDate *deadline = op.pendingDeadline;
+    if (deadline == nil) {
+        return nil;
+    }
+    
+    // A pending connection also needs time to be performed
+    if (![op isAdmitted] && self.minimumTimeToDeadline > 0.0) {
+        return [deadline dateByAddingTimeInterval:-self.minimumTimeToDeadline];
+    }
+    
+    return deadline;
+}
+
+- (void)expireOperation_:(MUKURLConnectionOperation_ *)op {
+    op.connection.deadlineExpired = YES;
+    [op cancel];
+}
+
+- (void)watchDeadlineOfOperation_:(MUKURLConnectionOperation_ *)op {
+    if (op.pendingDeadline) {
+        [self insertOperation_:op intoPendingOperations_:([op isAdmitted] ? self.admittedDeadlineOperations_ : self.deadlineOperations_)];
+    }
+}
+
+- (MUKURLConnectionOperation_ *)firstDeadlineOperationIn_:(NSMutableArray *)operations
+{
+    // Cancelled operations are leaving the queue: stop watching them
+    while ([operations count] && ([operations[0] isCancelled] || [operations[0] isFinished]))
+    {
+        [operations removeObjectAtIndex:0];
+    }
+    
+    return ([operations count] ? operations[0] : nil);
+}
+
+- (NSDate *)nextExpirationDate_ {
+    // Every operation in a list has the same margin, so first one expires first
+    NSDate *expirationDate = [self expirationDateForOperation_:[self firstDeadlineOperationIn_:self.deadlineOperations_]];
+    NSDate *admittedExpirationDate = [self expirationDateForOperation_:[self firstDeadlineOperationIn_:self.admittedDeadlineOperations_]];
+    
+    if (expirationDate == nil || (admittedExpirationDate && [admittedExpirationDate compare:expirationDate] == NSOrderedAscending))
+    {
+        return admittedExpirationDate;
+    }
+    
+    return expirationDate;
+}
+
+- (void)updateDeadlineTimer_ {
+    if (self.deadlineTimer_ == nil && [self.deadlineOperations_ count] == 0 &&
+        [self.admittedDeadlineOperations_ count] == 0)
+    {
+        // No deadline to watch
+        return;
+    }
+    
+    NSDate *fireDate = [self nextExpirationDate_];
+    if ([fireDate isEqualToDate:[self.deadlineTimer_ fireDate]]) {
+        return;
+    }
+    
+    [self.deadlineTimer_ invalidate];
+    self.deadlineTimer_ = nil;
+    
+    if (fireDate) {
+        // Timer retains queue until no more deadlines are watched
+        self.deadlineTimer_ = [[NSTimer alloc] initWithFireDate:fireDate interval:0.0 target:self selector:@selector(deadlineTimerFired_:) userInfo:nil repeats:NO];
+        [[NSRunLoop mainRunLoop] addTimer:self.deadlineTimer_ forMode:NSRunLoopCommonModes];
+    }
+}
+
+- (void)deadlineTimerFired_:(NSTimer *)timer {
+    self.deadlineTimer_ = nil;
+    
+    // Only expired operations are visited: they are dropped as they are cancelled
+    for (NSMutableArray *operations in @[self.deadlineOperations_, self.admittedDeadlineOperations_])
+    {
+        MUKURLConnectionOperation_ *op;
+        while ((op = [self firstDeadlineOperationIn_:operations])) {
+            if ([[self expirationDateForOperation_:op] timeIntervalSinceNow] > 0.0) {
+                break;
+            }
+            
+            [self expireOperation_:op];
+        }
+    }
+    
+    [self updateDeadlineTimer_];
+}
+
 #pragma mark - Private: Background
 
 - (void)beginBackgroundTaskIfNeededInOperation_:(MUKURLConnectionOperation_ *)op
@@ -0,0 +1,105 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+
+/**
+ This class keeps an append-only journal of connections enqueued in a
+ MUKURLConnectionQueue, so pending connections survive process termination.
+ 
+ You create a journal with a file path and you assign it to
+ [MUKURLConnectionQueue journal]. Queue records every connection it enqueues,
+ its progress and its completion. When application is relaunched you create
+ a journal with the same path and you call 
+ [MUKURLConnectionQueue addJournaledConnectionsWithConfigurationHandler:] in 
+ order to enqueue again connections which were pending, in one pass.
+ 
+ Journal records request, deadline, runsInBackground, deferrable, usesBuffer and
+ userInfo (if it can be archived, with every object it contains) of every
+ connection. userInfo is archived as connection is recorded. Handlers are not
+ recorded: set them again in configuration handler, maybe using 
+ [MUKURLConnection userInfo] to recognize connections.
+ 
+ Journal file is compacted automatically when it contains too many stale 
+ records. File operations are performed on a private serial dispatch queue.
+ */
+@interface MUKURLConnectionQueueJournal : NSObject
+/** @name Initializers */
+/**
+ Designated initializer.
+ 
+ Existing records at path are loaded, so a new journal keeps tracking
+ connections which were pending when last process was terminated.
+ 
+ @param path Path of journal file. File is created if it does not exist.
+ @return A new journal.
+ */
+- (id)initWithPath:(NSString *)path;
+
+/** @name Properties */
+/**
+ Path of journal file.
+ */
+@property (nonatomic, strong, readonly) NSString *path;
+/**
+ Journaled connections are resumed with a `Range` request header.
+ 
+ Default is `NO`. Set it to `YES` only if you persist received data by yourself
+ (e.g. writing chunks to a file in [MUKURLConnection progressHandler]) and
+ server supports byte ranges: connections recovered from journal will request
+ only bytes which were not received before termination.
+ */
+@property (nonatomic) BOOL resumesPartialTransfers;
+/**
+ Minimum amount of received bytes which produces a new progress record.
+ 
+ Default is 64 KB. Lower values make resume point more precise, but they write
+ journal more often.
+ */
+@property (nonatomic) long long progressGranularity;
+
+/** @name Methods */
+/**
+ Connections which were pending when journal was last written.
+ 
+ Connections are returned in the same order they were enqueued. They are 
+ not started, nor they are enqueued.
+ 
+ @return New MUKURLConnection instances, one for every pending record.
+ @see [MUKURLConnectionQueue addJournaledConnectionsWithConfigurationHandler:]
+ */
+- (NSArray *)pendingConnections;
+/**
+ Rewrites journal file keeping only records of pending connections.
+ 
+ You do not need to call this method, because journal is compacted 
+ automatically.
+ */
+- (void)compact;
+/**
+ Forgets every record and empties journal file.
+ */
+- (void)removeAllRecords;
+@end
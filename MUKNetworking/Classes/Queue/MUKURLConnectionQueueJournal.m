@@ -0,0 +1,473 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "MUKURLConnectionQueueJournal.h"
+#import "MUKURLConnectionQueueJournal_Queue.h"
+#import "MUKURLConnection.h"
+#import "MUKURLConnection_Queue.h"
+
+#define DEBUG_LOG      0
+
+static NSUInteger const kCompactionMinimumRecordsCount = 256;
+static NSUInteger const kCompactionStaleRecordsRatio = 4;
+
+static NSString *const kRecordTypeKey = @"type";
+static NSString *const kRecordTypeEnqueue = @"enqueue";
+static NSString *const kRecordTypeProgress = @"progress";
+static NSString *const kRecordTypeCompletion = @"completion";
+
+static NSString *const kRecordIdentifierKey = @"identifier";
+static NSString *const kRecordRequestKey = @"request";
+static NSString *const kRecordDeadlineKey = @"deadline";
+static NSString *const kRecordRunsInBackgroundKey = @"runsInBackground";
+static NSString *const kRecordDeferrableKey = @"deferrable";
+static NSString *const kRecordUsesBufferKey = @"usesBuffer";
+static NSString *const kRecordUserInfoDataKey = @"userInfoData";
+static NSString *const kRecordBytesKey = @"bytes";
+
+// Not written: only in memory
+static NSString *const kEntryOffsetKey = @"offset";
+
+@interface MUKURLConnectionQueueJournal ()
+@property (nonatomic, strong, readwrite) NSString *path;
+
+// Journal queue only
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_queue_t journalQueue_;
+#else
+@property (nonatomic, assign) dispatch_queue_t journalQueue_;
+#endif
+@property (nonatomic, strong) NSFileHandle *fileHandle_;
+@property (nonatomic, strong) NSMutableDictionary *entries_;
+@property (nonatomic, strong) NSMutableArray *entryIdentifiers_;
+@property (nonatomic) NSUInteger recordsCount_;
+
+- (void)load_;
+- (void)openFileHandle_;
+- (void)appendRecord_:(NSDictionary *)record;
+- (void)compactIfNeeded_;
+- (void)compact_;
+
+- (NSData *)frameForRecord_:(NSDictionary *)record;
+- (NSDictionary *)enqueueRecordForEntry_:(NSDictionary *)entry identifier:(NSString *)identifier;
+- (MUKURLConnection *)newConnectionForEntry_:(NSMutableDictionary *)entry identifier:(NSString *)identifier;
+
++ (NSString *)newIdentifier_;
+@end
+
+@implementation MUKURLConnectionQueueJournal
+@synthesize path = path_;
+@synthesize resumesPartialTransfers = resumesPartialTransfers_;
+@synthesize progressGranularity = progressGranularity_;
+@synthesize journalQueue_ = journalQueue__;
+@synthesize fileHandle_ = fileHandle__;
+@synthesize entries_ = entries__;
+@synthesize entryIdentifiers_ = entryIdentifiers__;
+@synthesize recordsCount_ = recordsCount__;
+
+- (id)init {
+    self = [self initWithPath:nil];
+    return self;
+}
+
+- (id)initWithPath:(NSString *)path {
+    self = [super init];
+    if (self) {
+        self.path = path;
+        self.progressGranularity = 64 * 1024;
+        
+        self.entries_ = [[NSMutableDictionary alloc] init];
+        self.entryIdentifiers_ = [[NSMutableArray alloc] init];
+        self.journalQueue_ = dispatch_queue_create("it.melive.mukit.muknetworking.journal", DISPATCH_QUEUE_SERIAL);
+        
+        dispatch_async(self.journalQueue_, ^{
+            [self load_];
+        });
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [fileHandle__ closeFile];
+    
+#if !OS_OBJECT_USE_OBJC
+    if (journalQueue__) {
+        dispatch_release(journalQueue__);
+    }
+#endif
+}
+
+#pragma mark - Methods
+
+- (NSArray *)pendingConnections {
+    NSMutableArray *connections = [NSMutableArray array];
+    
+    dispatch_sync(self.journalQueue_, ^{
+        for (NSString *identifier in self.entryIdentifiers_) {
+            NSMutableDictionary *entry = self.entries_[identifier];
+            MUKURLConnection *connection = [self newConnectionForEntry_:entry identifier:identifier];
+            
+            if (connection) {
+                [connections addObject:connection];
+            }
+        }
+    });
+    
+    return connections;
+}
+
+- (void)compact {
+    dispatch_async(self.journalQueue_, ^{
+        [self compact_];
+    });
+}
+
+- (void)removeAllRecords {
+    dispatch_async(self.journalQueue_, ^{
+        [self.entries_ removeAllObjects];
+        [self.entryIdentifiers_ removeAllObjects];
+        [self compact_];
+    });
+}
+
+#pragma mark - Queue
+
+- (void)recordConnection:(MUKURLConnection *)connection {
+    if (connection.journalIdentifier_ || connection.request == nil) {
+        // Already journaled
+        return;
+    }
+    
+    NSString *identifier = [[self class] newIdentifier_];
+    connection.journalIdentifier_ = identifier;
+    connection.journaledBytesCount_ = 0;
+    
+    // Capture values on caller thread
+    NSMutableDictionary *entry = [[NSMutableDictionary alloc] initWithCapacity:7];
+    entry[kRecordRequestKey] = connection.request;
+    entry[kRecordRunsInBackgroundKey] = @(connection.runsInBackground);
+    entry[kRecordUsesBufferKey] = @(connection.usesBuffer);
+    entry[kRecordDeferrableKey] = @(connection.deferrable);
+    entry[kRecordBytesKey] = @0LL;
+    
+    if (connection.deadline) {
+        entry[kRecordDeadlineKey] = connection.deadline;
+    }
+    
+    if (connection.userInfo) {
+        /*
+         Archive once: a collection could contain objects which can not be
+         archived. Connection is journaled without its userInfo in that case.
+         */
+        NSData *userInfoData;
+        @try {
+            userInfoData = [NSKeyedArchiver archivedDataWithRootObject:connection.userInfo];
+        }
+        @catch (NSException *exception) {
+            userInfoData = nil;
+        }
+        
+        if (userInfoData) {
+            entry[kRecordUserInfoDataKey] = userInfoData;
+        }
+    }
+    
+    dispatch_async(self.journalQueue_, ^{
+        self.entries_[identifier] = entry;
+        [self.entryIdentifiers_ addObject:identifier];
+        
+        [self appendRecord_:[self enqueueRecordForEntry_:entry identifier:identifier]];
+    });
+}
+
+- (void)recordProgressOfConnection:(MUKURLConnection *)connection {
+    NSString *identifier = connection.journalIdentifier_;
+    if (identifier == nil) {
+        return;
+    }
+    
+    long long receivedBytesCount = connection.receivedBytesCount;
+    if (receivedBytesCount < connection.journaledBytesCount_) {
+        // Connection has been restarted
+        connection.journaledBytesCount_ = 0;
+    }
+    
+    // Throttle here, so small chunks don't cost a dispatch each
+    if (receivedBytesCount - connection.journaledBytesCount_ < self.progressGranularity)
+    {
+        return;
+    }
+    
+    connection.journaledBytesCount_ = receivedBytesCount;
+    
+    dispatch_async(self.journalQueue_, ^{
+        NSMutableDictionary *entry = self.entries_[identifier];
+        if (entry == nil) {
+            return;
+        }
+        
+        long long bytes = [entry[kEntryOffsetKey] longLongValue] + receivedBytesCount;
+        entry[kRecordBytesKey] = @(bytes);
+        [self appendRecord_:@{ kRecordTypeKey : kRecordTypeProgress, kRecordIdentifierKey : identifier, kRecordBytesKey : @(bytes) }];
+    });
+}
+
+- (void)recordCompletionOfConnection:(MUKURLConnection *)connection {
+    NSString *identifier = connection.journalIdentifier_;
+    if (identifier == nil) {
+        return;
+    }
+    
+    connection.journalIdentifier_ = nil;
+    
+    dispatch_async(self.journalQueue_, ^{
+        if (self.entries_[identifier] == nil) {
+            return;
+        }
+        
+        [self.entries_ removeObjectForKey:identifier];
+        [self.entryIdentifiers_ removeObject:identifier];
+        
+        [self appendRecord_:@{ kRecordTypeKey : kRecordTypeCompletion, kRecordIdentifierKey : identifier }];
+    });
+}
+
+#pragma mark - Private
+
+- (void)load_ {
+    NSData *data = [[NSData alloc] initWithContentsOfFile:self.path options:NSDataReadingMappedIfSafe error:nil];
+    NSUInteger location = 0;
+    BOOL corrupted = NO;
+    
+    // Replay records in one pass
+    while (location < [data length]) {
+        uint32_t length;
+        if (location + sizeof(length) > [data length]) {
+            corrupted = YES;
+            break;
+        }
+        
+        [data getBytes:&length range:NSMakeRange(location, sizeof(length))];
+        length = CFSwapInt32BigToHost(length);
+        location += sizeof(length);
+        
+        if (location + length > [data length]) {
+            // Process was terminated while writing last record
+            corrupted = YES;
+            break;
+        }
+        
+        NSDictionary *record = nil;
+        @try {
+            record = [NSKeyedUnarchiver unarchiveObjectWithData:[data subdataWithRange:NSMakeRange(location, length)]];
+        }
+        @catch (NSException *exception) {
+            record = nil;
+        }
+        
+        if (![record isKindOfClass:[NSDictionary class]]) {
+            corrupted = YES;
+            break;
+        }
+        
+        location += length;
+        self.recordsCount_++;
+        
+        NSString *type = record[kRecordTypeKey];
+        NSString *identifier = record[kRecordIdentifierKey];
+        
+        if ([type isEqualToString:kRecordTypeEnqueue]) {
+            NSMutableDictionary *entry = [record mutableCopy];
+            [entry removeObjectForKey:kRecordTypeKey];
+            [entry removeObjectForKey:kRecordIdentifierKey];
+            
+            if (self.entries_[identifier] == nil) {
+                [self.entryIdentifiers_ addObject:identifier];
+            }
+            self.entries_[identifier] = entry;
+        }
+        else if ([type isEqualToString:kRecordTypeProgress]) {
+            NSMutableDictionary *entry = self.entries_[identifier];
+            entry[kRecordBytesKey] = record[kRecordBytesKey];
+        }
+        else if ([type isEqualToString:kRecordTypeCompletion]) {
+            [self.entries_ removeObjectForKey:identifier];
+            [self.entryIdentifiers_ removeObject:identifier];
+        }
+    }
+    
+#if DEBUG_LOG
+    NSLog(@"Journal loaded %i records, %i pending (%@)", self.recordsCount_, [self.entryIdentifiers_ count], self.path);
+#endif
+    
+    if (corrupted) {
+        // Drop garbage at the end of file
+        [self compact_];
+    }
+    else {
+        [self compactIfNeeded_];
+    }
+}
+
+- (void)openFileHandle_ {
+    if (self.fileHandle_) {
+        return;
+    }
+    
+    NSFileManager *fileManager = [[NSFileManager alloc] init];
+    if (![fileManager fileExistsAtPath:self.path]) {
+        [fileManager createFileAtPath:self.path contents:nil attributes:nil];
+    }
+    
+    self.fileHandle_ = [NSFileHandle fileHandleForWritingAtPath:self.path];
+    [self.fileHandle_ seekToEndOfFile];
+}
+
+- (void)appendRecord_:(NSDictionary *)record {
+    [self openFileHandle_];
+    
+    @try {
+        [self.fileHandle_ writeData:[self frameForRecord_:record]];
+        self.recordsCount_++;
+    }
+    @catch (NSException *exception) {
+        // Journal is best-effort: connections keep running
+#if DEBUG_LOG
+        NSLog(@"Journal write failed: %@", exception);
+#endif
+    }
+    
+    [self compactIfNeeded_];
+}
+
+- (void)compactIfNeeded_ {
+    NSUInteger staleRecordsCount = self.recordsCount_ - [self.entryIdentifiers_ count];
+    
+    if (self.recordsCount_ >= kCompactionMinimumRecordsCount &&
+        staleRecordsCount >= kCompactionStaleRecordsRatio * [self.entryIdentifiers_ count])
+    {
+        [self compact_];
+    }
+}
+
+- (void)compact_ {
+    // One enqueue record per pending connection, with last progress
+    NSMutableData *data = [[NSMutableData alloc] init];
+    for (NSString *identifier in self.entryIdentifiers_) {
+        NSDictionary *record = [self enqueueRecordForEntry_:self.entries_[identifier] identifier:identifier];
+        
+        @try {
+            [data appendData:[self frameForRecord_:record]];
+        }
+        @catch (NSException *exception) {
+            // Don't lose other records (or crash) because of this one
+#if DEBUG_LOG
+            NSLog(@"Journal could not archive record: %@", exception);
+#endif
+        }
+    }
+    
+    [self.fileHandle_ closeFile];
+    self.fileHandle_ = nil;
+    
+    if ([data writeToFile:self.path atomically:YES]) {
+        self.recordsCount_ = [self.entryIdentifiers_ count];
+    }
+    
+#if DEBUG_LOG
+    NSLog(@"Journal compacted to %i records (%@)", self.recordsCount_, self.path);
+#endif
+}
+
+- (NSData *)frameForRecord_:(NSDictionary *)record {
+    NSData *recordData = [NSKeyedArchiver archivedDataWithRootObject:record];
+    uint32_t length = CFSwapInt32HostToBig((uint32_t)[recordData length]);
+    
+    NSMutableData *frame = [[NSMutableData alloc] initWithCapacity:sizeof(length) + [recordData length]];
+    [frame appendBytes:&length length:sizeof(length)];
+    [frame appendData:recordData];
+    
+    return frame;
+}
+
+- (NSDictionary *)enqueueRecordForEntry_:(NSDictionary *)entry identifier:(NSString *)identifier
+{
+    NSMutableDictionary *record = [entry mutableCopy];
+    [record removeObjectForKey:kEntryOffsetKey];
+    record[kRecordTypeKey] = kRecordTypeEnqueue;
+    record[kRecordIdentifierKey] = identifier;
+    
+    return record;
+}
+
+- (MUKURLConnection *)newConnectionForEntry_:(NSMutableDictionary *)entry identifier:(NSString *)identifier
+{
+    NSURLRequest *request = entry[kRecordRequestKey];
+    if (request == nil) {
+        return nil;
+    }
+    
+    long long bytes = [entry[kRecordBytesKey] longLongValue];
+    if (self.resumesPartialTransfers && bytes > 0) {
+        NSMutableURLRequest *rangeRequest = [request mutableCopy];
+        [rangeRequest setValue:[NSString stringWithFormat:@"bytes=%lld-", bytes] forHTTPHeaderField:@"Range"];
+        request = rangeRequest;
+        
+        // New connection counts bytes from zero
+        entry[kEntryOffsetKey] = @(bytes);
+    }
+    else {
+        [entry removeObjectForKey:kEntryOffsetKey];
+    }
+    
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:request];
+    connection.runsInBackground = [entry[kRecordRunsInBackgroundKey] boolValue];
+    connection.usesBuffer = [entry[kRecordUsesBufferKey] boolValue];
+    connection.deferrable = [entry[kRecordDeferrableKey] boolValue];
+    connection.deadline = entry[kRecordDeadlineKey];
+    connection.journalIdentifier_ = identifier;
+    
+    NSData *userInfoData = entry[kRecordUserInfoDataKey];
+    if (userInfoData) {
+        @try {
+            connection.userInfo = [NSKeyedUnarchiver unarchiveObjectWithData:userInfoData];
+        }
+        @catch (NSException *exception) {
+            connection.userInfo = nil;
+        }
+    }
+    
+    return connection;
+}
+
++ (NSString *)newIdentifier_ {
+    CFUUIDRef uuid = CFUUIDCreate(kCFAllocatorDefault);
+    NSString *identifier = (__bridge_transfer NSString *)CFUUIDCreateString(kCFAllocatorDefault, uuid);
+    CFRelease(uuid);
+    
+    return identifier;
+}
+
+@end
@@ -0,0 +1,73 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+
+extern NSInteger const MUKURLConnectionSchedulerDefaultMaxConcurrentConnections;
+
+/**
+ This class enforces a connection budget shared by many MUKURLConnectionQueue
+ instances.
+ 
+ Every queue has its own [MUKURLConnectionQueue maximumConcurrentConnections],
+ so many queues together could start too many connections. Assign the same
+ scheduler to [MUKURLConnectionQueue scheduler] of every queue and the total 
+ number of running connections never exceeds maximumConcurrentConnections.
+ 
+ Budget is split among queues which have work, proportionally to
+ [MUKURLConnectionQueue schedulerWeight]: a queue is always allowed to run as 
+ many connections as its share. Capacity which is not used by other queues is 
+ lent to busy queues, so no slot is wasted; lent slots return to their queue
+ as borrowed connections finish, because a queue can not borrow while another
+ queue below its share is waiting. Freed slots are offered first to queues 
+ which are running fewer connections for their weight.
+ 
+ Prefetches (see [MUKURLConnectionQueue addPrefetchRequest:]) only take slots 
+ no queue is waiting for.
+ 
+ @warning Use scheduler on main queue.
+ */
+@interface MUKURLConnectionScheduler : NSObject
+/** @name Properties */
+/**
+ Maximum number of concurrent connections in every queue using the receiver.
+ 
+ Default: `MUKURLConnectionSchedulerDefaultMaxConcurrentConnections`, which 
+ is `6`.
+ */
+@property (nonatomic) NSInteger maximumConcurrentConnections;
+
+/** @name Methods */
+/**
+ Scheduler shared by the whole process.
+ @return Shared scheduler instance.
+ */
++ (MUKURLConnectionScheduler *)sharedScheduler;
+/**
+ Number of connections which are running in every queue using the receiver.
+ @return Number of connections which take a slot.
+ */
+- (NSInteger)runningConnectionsCount;
+@end
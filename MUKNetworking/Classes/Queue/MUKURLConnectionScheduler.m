@@ -0,0 +1,190 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "MUKURLConnectionScheduler.h"
+#import "MUKURLConnectionScheduler_Queue.h"
+#import "MUKURLConnectionQueue_Scheduler.h"
+
+NSInteger const MUKURLConnectionSchedulerDefaultMaxConcurrentConnections = 6;
+
+@interface MUKURLConnectionScheduler ()
+// Busy queues, main queue only
+@property (nonatomic, strong) NSMutableArray *queues_;
+@property (nonatomic) BOOL scheduling_, needsScheduling_;
+
+- (NSInteger)shareOfQueue_:(MUKURLConnectionQueue *)queue;
+@end
+
+@implementation MUKURLConnectionScheduler
+@synthesize maximumConcurrentConnections = maximumConcurrentConnections_;
+@synthesize queues_ = queues__;
+@synthesize scheduling_ = scheduling__, needsScheduling_ = needsScheduling__;
+
++ (MUKURLConnectionScheduler *)sharedScheduler {
+    static MUKURLConnectionScheduler *sharedScheduler = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedScheduler = [[MUKURLConnectionScheduler alloc] init];
+    });
+    
+    return sharedScheduler;
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        queues__ = [[NSMutableArray alloc] init];
+        maximumConcurrentConnections_ = MUKURLConnectionSchedulerDefaultMaxConcurrentConnections;
+    }
+    return self;
+}
+
+#pragma mark - Methods
+
+- (NSInteger)runningConnectionsCount {
+    NSInteger count = 0;
+    for (MUKURLConnectionQueue *queue in self.queues_) {
+        count += [queue scheduledConnectionsCount_];
+    }
+    
+    return count;
+}
+
+#pragma mark - Accessors
+
+- (void)setMaximumConcurrentConnections:(NSInteger)maximumConcurrentConnections
+{
+    maximumConcurrentConnections_ = maximumConcurrentConnections;
+    [self scheduleQueues];
+}
+
+#pragma mark - Private (Queue)
+
+- (void)updateQueue:(MUKURLConnectionQueue *)queue {
+    BOOL registered = [self.queues_ containsObject:queue];
+    BOOL busy = [queue isBusy_];
+    
+    if (busy && !registered) {
+        [self.queues_ addObject:queue];
+    }
+    else if (!busy && registered) {
+        // Idle queue does not take a share (and it could be dealloc'd)
+        [self.queues_ removeObject:queue];
+    }
+}
+
+- (void)removeQueue:(MUKURLConnectionQueue *)queue {
+    [self.queues_ removeObject:queue];
+    
+    // Its slots are free now
+    [self scheduleQueues];
+}
+
+- (BOOL)canAdmitConnectionInQueue:(MUKURLConnectionQueue *)queue speculative:(BOOL)speculative
+{
+    if ([self runningConnectionsCount] >= self.maximumConcurrentConnections) {
+        return NO;
+    }
+    
+    if (speculative) {
+        for (MUKURLConnectionQueue *otherQueue in self.queues_) {
+            if (otherQueue != queue && [otherQueue hasWaitingConnections_]) {
+                return NO;
+            }
+        }
+        
+        return YES;
+    }
+    
+    // Own share is guaranteed
+    if ((NSInteger)[queue scheduledConnectionsCount_] < [self shareOfQueue_:queue]) {
+        return YES;
+    }
+    
+    // Borrow idle capacity, unless someone is waiting for its own share
+    for (MUKURLConnectionQueue *otherQueue in self.queues_) {
+        if (otherQueue != queue && [otherQueue hasWaitingConnections_] &&
+            (NSInteger)[otherQueue scheduledConnectionsCount_] < [self shareOfQueue_:otherQueue])
+        {
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+- (void)scheduleQueues {
+    // Queues could ask for scheduling while they are admitting
+    if (self.scheduling_) {
+        self.needsScheduling_ = YES;
+        return;
+    }
+    
+    self.scheduling_ = YES;
+    
+    do {
+        self.needsScheduling_ = NO;
+        
+        // Most starved queues first
+        NSArray *queues = [self.queues_ sortedArrayUsingComparator:^NSComparisonResult(id obj1, id obj2)
+        {
+            double weight1 = [obj1 schedulerWeight], weight2 = [obj2 schedulerWeight];
+            double usage1 = (weight1 > 0.0 ? [obj1 scheduledConnectionsCount_]/weight1 : HUGE_VAL);
+            double usage2 = (weight2 > 0.0 ? [obj2 scheduledConnectionsCount_]/weight2 : HUGE_VAL);
+            
+            if (usage1 < usage2) return NSOrderedAscending;
+            if (usage1 > usage2) return NSOrderedDescending;
+            return NSOrderedSame;
+        }];
+        
+        for (MUKURLConnectionQueue *queue in queues) {
+            [queue admitScheduledOperations_];
+            [self updateQueue:queue];
+        }
+    } while (self.needsScheduling_);
+    
+    self.scheduling_ = NO;
+}
+
+#pragma mark - Private
+
+- (NSInteger)shareOfQueue_:(MUKURLConnectionQueue *)queue {
+    NSUInteger weight = queue.schedulerWeight;
+    if (weight == 0) {
+        // It only uses spare capacity
+        return 0;
+    }
+    
+    NSUInteger totalWeight = ([self.queues_ containsObject:queue] ? 0 : weight);
+    for (MUKURLConnectionQueue *otherQueue in self.queues_) {
+        totalWeight += otherQueue.schedulerWeight;
+    }
+    
+    // Every busy queue can run at least one connection
+    NSInteger share = (self.maximumConcurrentConnections * weight) / totalWeight;
+    return MAX(share, 1);
+}
+
+@end
@@ -0,0 +1,52 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+
+extern NSString *const MUKURLConnectionBatchResponseKey;
+extern NSString *const MUKURLConnectionBatchDataKey;
+
+/*
+ Encodes many requests into one multipart/mixed request (one application/http
+ part per request) and decodes multipart/mixed reply into one result per
+ request.
+ */
+@interface MUKURLConnectionBatch_ : NSObject
+
+/*
+ Every part carries request body (with its Content-Length).
+ Requests should not have a body stream: it can not be copied into a part.
+ */
++ (NSURLRequest *)newBatchRequestWithRequests:(NSArray *)requests endpointURL:(NSURL *)endpointURL;
+
+/*
+ One object per request, in the same order: a dictionary with 
+ MUKURLConnectionBatchResponseKey and MUKURLConnectionBatchDataKey, or NSNull
+ if reply does not contain a valid part for that request.
+ Returns nil if reply is not a multipart/mixed message.
+ */
++ (NSArray *)resultsWithRequests:(NSArray *)requests batchResponse:(NSURLResponse *)response data:(NSData *)data;
+
+@end
@@ -0,0 +1,280 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "MUKURLConnectionBatch_.h"
+
+NSString *const MUKURLConnectionBatchResponseKey = @"response";
+NSString *const MUKURLConnectionBatchDataKey = @"data";
+
+static NSString *const kContentIDPrefix = @"item-";
+
+@interface MUKURLConnectionBatch_ ()
++ (NSString *)newBoundary_;
++ (NSString *)boundaryFromContentType_:(NSString *)contentType;
++ (NSArray *)partsInData_:(NSData *)data boundary:(NSString *)boundary;
++ (NSDictionary *)headerFieldsInString_:(NSString *)string firstLine:(NSString **)firstLine;
++ (NSInteger)requestIndexForContentID_:(NSString *)contentID;
+@end
+
+@implementation MUKURLConnectionBatch_
+
++ (NSURLRequest *)newBatchRequestWithRequests:(NSArray *)requests endpointURL:(NSURL *)endpointURL
+{
+    NSString *boundary = [self newBoundary_];
+    NSMutableData *body = [[NSMutableData alloc] init];
+    
+    [requests enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) 
+    {
+        NSURLRequest *request = obj;
+        NSURL *URL = [request URL];
+        
+        NSString *path = [URL path];
+        if ([path length] == 0) {
+            path = @"/";
+        }
+        if ([URL query]) {
+            path = [path stringByAppendingFormat:@"?%@", [URL query]];
+        }
+        
+        NSMutableString *part = [[NSMutableString alloc] init];
+        [part appendFormat:@"--%@\r\n", boundary];
+        [part appendString:@"Content-Type: application/http\r\n"];
+        [part appendFormat:@"Content-ID: <%@%lu>\r\n\r\n", kContentIDPrefix, (unsigned long)idx];
+        [part appendFormat:@"%@ %@ HTTP/1.1\r\n", [request HTTPMethod], path];
+        [part appendFormat:@"Host: %@\r\n", [URL host]];
+        
+        [[request allHTTPHeaderFields] enumerateKeysAndObjectsUsingBlock:^(id key, id value, BOOL *stop) 
+        {
+            // Length is written below, from body which is actually sent
+            if ([key caseInsensitiveCompare:@"Content-Length"] != NSOrderedSame) {
+                [part appendFormat:@"%@: %@\r\n", key, value];
+            }
+        }];
+        
+        NSData *HTTPBody = [request HTTPBody];
+        if ([HTTPBody length]) {
+            [part appendFormat:@"Content-Length: %lu\r\n", (unsigned long)[HTTPBody length]];
+        }
+        
+        [part appendString:@"\r\n"];
+        [body appendData:[part dataUsingEncoding:NSUTF8StringEncoding]];
+        
+        if ([HTTPBody length]) {
+            [body appendData:HTTPBody];
+            [body appendData:[@"\r\n" dataUsingEncoding:NSUTF8StringEncoding]];
+        }
+    }];
+    
+    [body appendData:[[NSString stringWithFormat:@"--%@--\r\n", boundary] dataUsingEncoding:NSUTF8StringEncoding]];
+    
+    NSURLRequest *firstRequest = [requests count] ? requests[0] : nil;
+    NSMutableURLRequest *batchRequest = [[NSMutableURLRequest alloc] initWithURL:endpointURL cachePolicy:NSURLRequestReloadIgnoringLocalCacheData timeoutInterval:(firstRequest ? [firstRequest timeoutInterval] : 60.0)];
+    [batchRequest setHTTPMethod:@"POST"];
+    [batchRequest setValue:[NSString stringWithFormat:@"multipart/mixed; boundary=%@", boundary] forHTTPHeaderField:@"Content-Type"];
+    [batchRequest setHTTPBody:body];
+    
+    return batchRequest;
+}
+
++ (NSArray *)resultsWithRequests:(NSArray *)requests batchResponse:(NSURLResponse *)response data:(NSData *)data
+{
+    if (![response isKindOfClass:[NSHTTPURLResponse class]]) {
+        return nil;
+    }
+    
+    NSHTTPURLResponse *HTTPResponse = (NSHTTPURLResponse *)response;
+    NSString *contentType = [HTTPResponse allHeaderFields][@"Content-Type"];
+    NSString *boundary = [self boundaryFromContentType_:contentType];
+    if (boundary == nil) {
+        return nil;
+    }
+    
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[requests count]];
+    for (NSUInteger i = 0; i < [requests count]; i++) {
+        [results addObject:[NSNull null]];
+    }
+    
+    NSData *separatorData = [@"\r\n\r\n" dataUsingEncoding:NSUTF8StringEncoding];
+    NSArray *parts = [self partsInData_:data boundary:boundary];
+    
+    [parts enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) 
+    {
+        NSData *part = obj;
+        
+        // Part headers
+        NSRange separatorRange = [part rangeOfData:separatorData options:0 range:NSMakeRange(0, [part length])];
+        if (separatorRange.location == NSNotFound) {
+            return;
+        }
+        
+        NSString *partHeaderString = [[NSString alloc] initWithData:[part subdataWithRange:NSMakeRange(0, separatorRange.location)] encoding:NSUTF8StringEncoding];
+        NSDictionary *partHeaderFields = [self headerFieldsInString_:[partHeaderString stringByAppendingString:@"\r\n"] firstLine:NULL];
+        
+        // Match by Content-ID, then by position
+        NSInteger requestIndex = [self requestIndexForContentID_:partHeaderFields[@"Content-ID"]];
+        if (requestIndex == NSNotFound) {
+            requestIndex = idx;
+        }
+        
+        if (requestIndex < 0 || requestIndex >= (NSInteger)[requests count]) {
+            return;
+        }
+        
+        // Embedded HTTP response
+        NSUInteger messageLocation = NSMaxRange(separatorRange);
+        NSRange messageSeparatorRange = [part rangeOfData:separatorData options:0 range:NSMakeRange(messageLocation, [part length] - messageLocation)];
+        if (messageSeparatorRange.location == NSNotFound) {
+            return;
+        }
+        
+        NSString *messageHeaderString = [[NSString alloc] initWithData:[part subdataWithRange:NSMakeRange(messageLocation, messageSeparatorRange.location - messageLocation)] encoding:NSUTF8StringEncoding];
+        
+        NSString *statusLine = nil;
+        NSDictionary *headerFields = [self headerFieldsInString_:messageHeaderString firstLine:&statusLine];
+        NSArray *statusComponents = [statusLine componentsSeparatedByString:@" "];
+        if ([statusComponents count] < 2 || ![statusComponents[0] hasPrefix:@"HTTP/"]) {
+            return;
+        }
+        
+        NSInteger statusCode = [statusComponents[1] integerValue];
+        NSURL *URL = [requests[requestIndex] URL];
+        NSHTTPURLResponse *partResponse = [[NSHTTPURLResponse alloc] initWithURL:URL statusCode:statusCode HTTPVersion:statusComponents[0] headerFields:headerFields];
+        
+        NSUInteger bodyLocation = NSMaxRange(messageSeparatorRange);
+        NSData *body = [part subdataWithRange:NSMakeRange(bodyLocation, [part length] - bodyLocation)];
+        
+        results[requestIndex] = @{ MUKURLConnectionBatchResponseKey : partResponse, MUKURLConnectionBatchDataKey : body };
+    }];
+    
+    return results;
+}
+
+#pragma mark - Private
+
++ (NSString *)newBoundary_ {
+    CFUUIDRef uuid = CFUUIDCreate(kCFAllocatorDefault);
+    NSString *UUIDString = (__bridge_transfer NSString *)CFUUIDCreateString(kCFAllocatorDefault, uuid);
+    CFRelease(uuid);
+    
+    return [@"batch_" stringByAppendingString:UUIDString];
+}
+
++ (NSString *)boundaryFromContentType_:(NSString *)contentType {
+    if (![[contentType lowercaseString] hasPrefix:@"multipart/mixed"]) {
+        return nil;
+    }
+    
+    for (NSString *component in [contentType componentsSeparatedByString:@";"]) {
+        NSString *parameter = [component stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+        
+        if ([[parameter lowercaseString] hasPrefix:@"boundary="]) {
+            NSString *boundary = [parameter substringFromIndex:[@"boundary=" length]];
+            return [boundary stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"\""]];
+        }
+    }
+    
+    return nil;
+}
+
++ (NSArray *)partsInData_:(NSData *)data boundary:(NSString *)boundary {
+    NSData *delimiterData = [[NSString stringWithFormat:@"--%@", boundary] dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *lineBreakData = [@"\r\n" dataUsingEncoding:NSUTF8StringEncoding];
+    NSMutableArray *parts = [NSMutableArray array];
+    
+    NSRange delimiterRange = [data rangeOfData:delimiterData options:0 range:NSMakeRange(0, [data length])];
+    while (delimiterRange.location != NSNotFound) {
+        NSUInteger partLocation = NSMaxRange(delimiterRange);
+        
+        // Close delimiter
+        if (partLocation + 2 <= [data length] &&
+            memcmp((const char *)[data bytes] + partLocation, "--", 2) == 0)
+        {
+            break;
+        }
+        
+        // Skip line break after delimiter
+        if (partLocation + [lineBreakData length] <= [data length]) {
+            partLocation += [lineBreakData length];
+        }
+        
+        NSRange nextDelimiterRange = [data rangeOfData:delimiterData options:0 range:NSMakeRange(partLocation, [data length] - partLocation)];
+        if (nextDelimiterRange.location == NSNotFound) {
+            break;
+        }
+        
+        // Line break before delimiter belongs to delimiter
+        NSUInteger partEnd = nextDelimiterRange.location;
+        if (partEnd >= partLocation + [lineBreakData length]) {
+            partEnd -= [lineBreakData length];
+        }
+        
+        [parts addObject:[data subdataWithRange:NSMakeRange(partLocation, partEnd - partLocation)]];
+        delimiterRange = nextDelimiterRange;
+    }
+    
+    return parts;
+}
+
++ (NSDictionary *)headerFieldsInString_:(NSString *)string firstLine:(NSString **)firstLine
+{
+    NSMutableDictionary *headerFields = [NSMutableDictionary dictionary];
+    NSArray *lines = [string componentsSeparatedByString:@"\r\n"];
+    
+    [lines enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
+        if (idx == 0 && firstLine) {
+            *firstLine = obj;
+            return;
+        }
+        
+        NSRange colonRange = [obj rangeOfString:@":"];
+        if (colonRange.location == NSNotFound) {
+            return;
+        }
+        
+        NSString *name = [[obj substringToIndex:colonRange.location] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+        NSString *value = [[obj substringFromIndex:NSMaxRange(colonRange)] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+        headerFields[name] = value;
+    }];
+    
+    return headerFields;
+}
+
++ (NSInteger)requestIndexForContentID_:(NSString *)contentID {
+    // Replies usually use <response-item-N>
+    NSRange prefixRange = [contentID rangeOfString:kContentIDPrefix];
+    if (prefixRange.location == NSNotFound) {
+        return NSNotFound;
+    }
+    
+    NSScanner *scanner = [NSScanner scannerWithString:[contentID substringFromIndex:NSMaxRange(prefixRange)]];
+    NSInteger index;
+    if (![scanner scanInteger:&index]) {
+        return NSNotFound;
+    }
+    
+    return index;
+}
+
+@end
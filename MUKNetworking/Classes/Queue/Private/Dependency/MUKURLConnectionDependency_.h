@@ -0,0 +1,47 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+#import <MUKNetworking/MUKURLConnectionQueue.h>
+
+/*
+ A connection which waits for another connection to reach a stage.
+ Main queue only.
+ */
+@interface MUKURLConnectionDependency_ : NSObject
+@property (nonatomic, strong, readonly) MUKURLConnection *connection, *dependency;
+@property (nonatomic, readonly) MUKURLConnectionQueueDependencyStage stage;
+@property (nonatomic, readonly) long long receivedBytesCount;
+
+// Set by queue as dependency reaches stage
+@property (nonatomic, getter = isSatisfied) BOOL satisfied;
+
+- (id)initWithConnection:(MUKURLConnection *)connection dependency:(MUKURLConnection *)dependency stage:(MUKURLConnectionQueueDependencyStage)stage receivedBytesCount:(long long)receivedBytesCount;
+
+/*
+ Returns YES if dependency has reached stage in its current transfer
+ */
+- (BOOL)isSatisfiedByDependencyWithResponse:(BOOL)responseReceived;
+@end
@@ -0,0 +1,66 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "MUKURLConnectionDependency_.h"
+
+@interface MUKURLConnectionDependency_ ()
+@property (nonatomic, strong, readwrite) MUKURLConnection *connection, *dependency;
+@property (nonatomic, readwrite) MUKURLConnectionQueueDependencyStage stage;
+@property (nonatomic, readwrite) long long receivedBytesCount;
+@end
+
+@implementation MUKURLConnectionDependency_
+@synthesize connection = connection_, dependency = dependency_;
+@synthesize stage = stage_;
+@synthesize receivedBytesCount = receivedBytesCount_;
+@synthesize satisfied = satisfied_;
+
+- (id)initWithConnection:(MUKURLConnection *)connection dependency:(MUKURLConnection *)dependency stage:(MUKURLConnectionQueueDependencyStage)stage receivedBytesCount:(long long)receivedBytesCount
+{
+    self = [super init];
+    if (self) {
+        self.connection = connection;
+        self.dependency = dependency;
+        self.stage = stage;
+        self.receivedBytesCount = receivedBytesCount;
+    }
+    return self;
+}
+
+- (BOOL)isSatisfiedByDependencyWithResponse:(BOOL)responseReceived {
+    switch (self.stage) {
+        case MUKURLConnectionQueueDependencyStageResponse:
+            return responseReceived;
+            
+        case MUKURLConnectionQueueDependencyStageReceivedBytes:
+            return (responseReceived && self.dependency.receivedBytesCount >= self.receivedBytesCount);
+            
+        default:
+            // Only a successful completion satisfies it
+            return NO;
+    }
+}
+
+@end
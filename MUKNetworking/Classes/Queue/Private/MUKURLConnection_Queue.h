@@ -34,4 +34,31 @@
  Called when -cancel is invoked
  */
 @property (nonatomic, copy) void (^operationCancelHandler_)(void);
+/*
+ Called after responseHandler
+ */
+@property (nonatomic, copy) void (^operationResponseHandler_)(NSURLResponse *response);
+/*
+ Called after progressHandler
+ */
+@property (nonatomic, copy) void (^operationProgressHandler_)(void);
+/*
+ Set by queue before to cancel a connection which can not meet its deadline
+ */
+@property (nonatomic, assign, readwrite, getter = isDeadlineExpired) BOOL deadlineExpired;
+/*
+ Set by queue when connection is recorded into a journal
+ */
+@property (nonatomic, copy) NSString *journalIdentifier_;
+/*
+ receivedBytesCount when journal last recorded progress of connection, so
+ journal is not bothered by every chunk
+ */
+@property (nonatomic, assign) long long journaledBytesCount_;
+/*
+ Set by queue as connection leaves it, so dependencies on a finished connection
+ can be resolved
+ */
+@property (nonatomic, assign, getter = isFinishedInQueue_) BOOL finishedInQueue_;
+@property (nonatomic, assign, getter = isSucceededInQueue_) BOOL succeededInQueue_;
 @end
@@ -33,9 +33,60 @@
 // Set/unset by queue
 @property (nonatomic) UIBackgroundTaskIdentifier backgroundTaskIdentifier;
 
+// Set by queue: operation is not ready until it is admitted
+@property (atomic, getter = isAdmitted) BOOL admitted;
+
+// Set by queue: insertion order, used to break ties while scheduling
+@property (nonatomic) NSUInteger sequenceNumber;
+
+// Set by queue: deadline connection had when it was enqueued (sort key)
+@property (nonatomic, strong) NSDate *pendingDeadline;
+
+// Set by queue: prefetch operations are not reported through queue callbacks
+@property (nonatomic, getter = isPrefetch) BOOL prefetch;
+
+// Set by queue: a prefetch which a foreground connection is following
+@property (nonatomic, getter = isPromoted) BOOL promoted;
+
+// Set by queue: method, URL and header fields which prefetches are matched by
+@property (nonatomic, copy) NSString *prefetchKey;
+
+// Set by queue: connection is fed by a prefetch, so it does not take a slot
+@property (nonatomic, getter = isFollower) BOOL follower;
+
+// Set by queue: operations whose connections are fed by this one (main queue only)
+@property (nonatomic, strong) NSMutableArray *followerOperations;
+
+// Set by queue: a multipart request which carries followers' requests
+@property (nonatomic, getter = isBatch) BOOL batch;
+
+// Set by queue: batch operation which carries this connection's request
+@property (nonatomic, weak) MUKURLConnectionOperation_ *batchOperation;
+
+// Set by queue: part of batch reply, kept until connection is started
+@property (nonatomic, strong) NSDictionary *batchResult;
+
+// Set by queue: when connection has been deferred (queue clock)
+@property (nonatomic, strong) NSDate *deferralDate;
+
+// Last response received by connection
+@property (nonatomic, strong) NSURLResponse *response;
+
+// YES if connection has finished loading without errors
+@property (atomic, getter = isSucceeded) BOOL succeeded;
+
 // Called on main queue
 @property (nonatomic, copy) void (^connectionWillStartHandler)(void);
 
+// Called on main queue instead of [MUKURLConnection start], if set
+@property (nonatomic, copy) void (^connectionStartHandler)(void);
+
+// Called on main queue, as connection receives a response
+@property (nonatomic, copy) void (^connectionResponseHandler)(void);
+
+// Called on main queue, as connection receives data
+@property (nonatomic, copy) void (^connectionProgressHandler)(void);
+
 - (id)initWithConnection:(MUKURLConnection *)connection;
 
 @end
@@ -41,7 +41,24 @@
 @implementation MUKURLConnectionOperation_
 @synthesize connection = connection_;
 @synthesize connectionWillStartHandler = connectionWillStartHandler_;
+@synthesize connectionStartHandler = connectionStartHandler_;
+@synthesize connectionResponseHandler = connectionResponseHandler_;
+@synthesize connectionProgressHandler = connectionProgressHandler_;
+@synthesize prefetch = prefetch_;
+@synthesize promoted = promoted_;
+@synthesize prefetchKey = prefetchKey_;
+@synthesize follower = follower_;
+@synthesize followerOperations = followerOperations_;
+@synthesize batch = batch_;
+@synthesize batchOperation = batchOperation_;
+@synthesize batchResult = batchResult_;
+@synthesize response = response_;
+@synthesize deferralDate = deferralDate_;
+@synthesize succeeded = succeeded_;
 @synthesize backgroundTaskIdentifier = backgroundTaskIdentifier_;
+@synthesize admitted = admitted_;
+@synthesize sequenceNumber = sequenceNumber_;
+@synthesize pendingDeadline = pendingDeadline_;
 
 @synthesize isExecuting_ = isExecuting__, isFinished_ = isFinished__;
 @synthesize isCancelled_ = isCancelled__;
@@ -71,21 +88,38 @@
 #endif
     self.connection.operationCancelHandler_ = nil;
     self.connection.operationCompletionHandler_ = nil;
+    self.connection.operationProgressHandler_ = nil;
+    self.connection.operationResponseHandler_ = nil;
     
     self.connectionWillStartHandler = nil;
+    self.connectionStartHandler = nil;
+    self.connectionResponseHandler = nil;
+    self.connectionProgressHandler = nil;
     self.completionBlock = nil;
 }
 
 #pragma mark - Overrides
 
 - (void)start {
+    /*
+     Always check for cancellation.
+     A cancelled operation finishes on current thread, so bulk cancellation
+     does not hop to main thread once per operation.
+     */
+    if ([self isCancelled]) {
+        [self willChangeValueForKey:@"isFinished"];
+        self.isFinished_ = YES;
+        [self didChangeValueForKey:@"isFinished"];
+        return;
+    }
+    
     // Ensure start in called on main thread
     if (![NSThread isMainThread]) {
         [self performSelectorOnMainThread:@selector(start) withObject:self waitUntilDone:NO];
         return;
     }
-        
-    // Always check for cancellation
+    
+    // Could have been cancelled while hopping to main thread
     if ([self isCancelled]) {
         [self willChangeValueForKey:@"isFinished"];
         self.isFinished_ = YES;
@@ -105,14 +139,20 @@
     
     // Don't start connection if user cancelled it
     if ([self isCancelled]) {
-        [self willChangeValueForKey:@"isFinished"];
-        self.isFinished_ = YES;
-        [self didChangeValueForKey:@"isFinished"];
+        // Cancellation could have already finished operation
+        if (![self isFinished]) {
+            [self finish_];
+        }
         return;
     }
     
     // Start connection
-    [self.connection start];
+    if (self.connectionStartHandler) {
+        self.connectionStartHandler();
+    }
+    else {
+        [self.connection start];
+    }
 }
 
 - (void)cancel {    
@@ -121,9 +161,17 @@
     self.connection.operationCancelHandler_ = nil;
     [self.connection cancel];
     
+    // A cancelled operation becomes ready in order to leave the queue
+    [self willChangeValueForKey:@"isReady"];
     [self willChangeValueForKey:@"isCancelled"];
     self.isCancelled_ = YES;
     [self didChangeValueForKey:@"isCancelled"];
+    [self didChangeValueForKey:@"isReady"];
+    
+    // Cancelled connection will not complete: leave the queue now
+    if ([self isExecuting]) {
+        [self finish_];
+    }
 }
 
 - (BOOL)isFinished {
@@ -138,6 +186,26 @@
     return self.isExecuting_;
 }
 
+- (BOOL)isReady {
+    if ([self isCancelled]) {
+        return YES;
+    }
+    
+    return (self.admitted && [super isReady]);
+}
+
+#pragma mark - Accessors
+
+- (BOOL)isAdmitted {
+    return admitted_;
+}
+
+- (void)setAdmitted:(BOOL)admitted {
+    [self willChangeValueForKey:@"isReady"];
+    admitted_ = admitted;
+    [self didChangeValueForKey:@"isReady"];
+}
+
 #pragma mark - Private
 
 - (void)setupHandlers_ {
@@ -151,11 +219,34 @@
         }
     };
     
+    self.connection.operationResponseHandler_ = ^(NSURLResponse *response) {
+        // Called in main queue
+        if (weakSelf) {
+            MUKURLConnectionOperation_ *strongSelf = weakSelf;
+            strongSelf.response = response;
+            
+            if (strongSelf.connectionResponseHandler) {
+                strongSelf.connectionResponseHandler();
+            }
+        }
+    };
+    
+    self.connection.operationProgressHandler_ = ^{
+        // Called in main queue
+        if (weakSelf) {
+            MUKURLConnectionOperation_ *strongSelf = weakSelf;
+            if (strongSelf.connectionProgressHandler) {
+                strongSelf.connectionProgressHandler();
+            }
+        }
+    };
+    
     self.connection.operationCompletionHandler_ = ^(BOOL success, NSError *error) 
     {
         // Called in main queue
         if (weakSelf) {
             MUKURLConnectionOperation_ *strongSelf = weakSelf;
+            strongSelf.succeeded = success;
             [strongSelf finish_];
         }
     };
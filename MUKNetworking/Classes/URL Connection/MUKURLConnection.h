@@ -58,6 +58,7 @@
  */
 
 #import <Foundation/Foundation.h>
+#import <MUKNetworking/MUKURLConnectionRedirectCache.h>
              
 extern float const MUKURLConnectionUnknownQuota;
 
@@ -90,6 +91,37 @@ extern float const MUKURLConnectionUnknownQuota;
  ended when connection finishes or it is cancelled.
  */
 @property (nonatomic, assign) BOOL runsInBackground;
+/**
+ Point in time after which connection result is no longer useful.
+ 
+ Default is `nil`, which means connection has no deadline.
+ 
+ Deadline is enforced by MUKURLConnectionQueue, both while connection is
+ waiting to be started and while it is transferring data: queue starts pending
+ connections in earliest-deadline-first order and it cancels connections which
+ can not meet their deadline. Queue uses the deadline connection had when it
+ was enqueued, so set it before to enqueue connection.
+ 
+ @see deadlineExpired
+ */
+@property (nonatomic, strong) NSDate *deadline;
+/**
+ `YES` if connection has been cancelled by its queue because deadline could
+ not be met.
+ 
+ *Default value*: `NO`. This value is reset to `NO` when start is invoked.
+ */
+@property (nonatomic, assign, readonly, getter = isDeadlineExpired) BOOL deadlineExpired;
+/**
+ `YES` if connection is low-priority traffic which could be delayed.
+ 
+ *Default value*: `NO`.
+ 
+ Deferral is enforced by MUKURLConnectionQueue: if queue has a
+ [MUKURLConnectionQueue maximumDeferralInterval], deferrable connections are 
+ held and started in bursts, so they do not wake the radio up one by one.
+ */
+@property (nonatomic, assign, getter = isDeferrable) BOOL deferrable;
 /**
  Number of bytes received by the connection.
  
@@ -110,6 +142,30 @@ extern float const MUKURLConnectionUnknownQuota;
  Custom object you could attach to connection.
  */
 @property (nonatomic, strong) id userInfo;
+/**
+ Cache of permanent redirects used by the connection.
+ 
+ *Default value*: `nil`, which means every redirect is resolved by server.
+ 
+ If set, connection records `301` and `308` redirects it receives and, when
+ start is invoked, `GET` and `HEAD` requests to a cached URL are sent directly 
+ to redirected URL. Cached rewrite passes through redirectHandler like a real 
+ redirect, with a synthesized `301` response: return `nil` to veto it and send
+ original request, or return another request to override it. request property
+ is never changed, and neither is cache: veto and override only apply to the
+ connection.
+ 
+ Only `301` and `308` responses sent by server are recorded, after 
+ redirectHandler runs, with the request it returns: a vetoed permanent redirect
+ is removed from cache. A cached redirect is also removed when its destination
+ answers `404` or `410`, or when its host can not be found or reached. Other
+ failures (e.g. device is offline, a timeout, a `401` or a `503`) could be
+ transient, so they keep the redirect.
+ 
+ Use [MUKURLConnectionRedirectCache sharedCache] to share redirects among 
+ connections and launches.
+ */
+@property (nonatomic, strong) MUKURLConnectionRedirectCache *redirectCache;
 
 /** @name Handlers */
 /**
@@ -229,8 +285,11 @@ extern float const MUKURLConnectionUnknownQuota;
 /**
  This callback signals when connection receives a redirection response.
  
- Default implementation of this method calls redirectHandler. If no redirectHandler
- is set, it returns request as is.
+ Default implementation of this method records permanent redirects in 
+ redirectCache, then it calls redirectHandler. If no redirectHandler is set, it 
+ returns request as is.
+ 
+ This callback is also called by start when redirectCache rewrites request.
  
  This callback is called by internal NSURLConnection delegate implementation of
  `- (NSURLRequest *)connection:(NSURLConnection *)connection willSendRequest:(NSURLRequest *)request redirectResponse:(NSURLResponse *)redirectResponse`.
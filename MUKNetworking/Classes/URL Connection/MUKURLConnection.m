@@ -34,8 +34,13 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
 @property (nonatomic, strong) NSURLConnection *connection_;
 @property (nonatomic, assign, readwrite) long long receivedBytesCount, expectedBytesCount;
 @property (nonatomic, strong) NSMutableData *buffer_;
+// URL whose cached redirect has been used by current transfer
+@property (nonatomic, strong) NSURL *rewrittenURL_;
 
 - (void)nullifyInternalURLConnection_;
+- (NSURLRequest *)requestRewrittenWithRedirectCache_;
+- (void)recordRedirectToRequest_:(NSURLRequest *)request redirectResponse:(NSURLResponse *)redirectResponse;
+- (void)invalidateRewrittenRedirect_;
 
 - (void)createBufferIfNeeded_:(NSURLResponse *)response;
 - (void)appendDataToBufferIfNeeded_:(NSData *)data;
@@ -46,8 +51,12 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
 @synthesize request = request_;
 @synthesize usesBuffer = usesBuffer_;
 @synthesize runsInBackground = runsInBackground_;
+@synthesize deadline = deadline_;
+@synthesize deadlineExpired = deadlineExpired_;
+@synthesize deferrable = deferrable_;
 @synthesize receivedBytesCount = receivedBytesCount_, expectedBytesCount = expectedBytesCount_;
 @synthesize userInfo = userInfo_;
+@synthesize redirectCache = redirectCache_;
 @synthesize completionHandler = completionHandler_;
 @synthesize responseHandler = responseHandler_;
 @synthesize progressHandler = progressHandler_;
@@ -55,10 +64,17 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
 
 @synthesize connection_;
 @synthesize buffer_;
+@synthesize rewrittenURL_ = rewrittenURL__;
 @synthesize backgroundTaskIdentifier_ = backgroundTaskIdentifier__;
 
 @synthesize operationCompletionHandler_ = operationCompletionHandler__;
 @synthesize operationCancelHandler_ = operationCancelHandler__;
+@synthesize operationResponseHandler_ = operationResponseHandler__;
+@synthesize operationProgressHandler_ = operationProgressHandler__;
+@synthesize journalIdentifier_ = journalIdentifier__;
+@synthesize journaledBytesCount_ = journaledBytesCount__;
+@synthesize finishedInQueue_ = finishedInQueue__;
+@synthesize succeededInQueue_ = succeededInQueue__;
 
 
 - (id)init {
@@ -94,8 +110,11 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
         return NO;
     }
     
+    self.deadlineExpired = NO;
     [self beginBackgroundTaskIfNeeded_];
-    self.connection_ = [[NSURLConnection alloc] initWithRequest:self.request delegate:self];
+    
+    NSURLRequest *request = [self requestRewrittenWithRedirectCache_];
+    self.connection_ = [[NSURLConnection alloc] initWithRequest:request delegate:self];
     
     return (self.connection_ != nil);
 }
@@ -130,6 +149,15 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
 #pragma mark - Callbacks
 
 - (void)didFailWithError:(NSError *)error {
+    // Cached destination host could be gone (but not if device is offline)
+    if ([[error domain] isEqualToString:NSURLErrorDomain] &&
+        ([error code] == NSURLErrorCannotFindHost ||
+         [error code] == NSURLErrorCannotConnectToHost ||
+         [error code] == NSURLErrorDNSLookupFailed))
+    {
+        [self invalidateRewrittenRedirect_];
+    }
+    
     if (self.completionHandler) {
         self.completionHandler(NO, error);
     }
@@ -159,6 +187,10 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
     
     [self appendDataToBufferIfNeeded_:data];
     if (self.progressHandler) self.progressHandler(data, quota);
+    
+    if (self.operationProgressHandler_) {
+        self.operationProgressHandler_();
+    }
 }
 
 - (void)didReceiveResponse:(NSURLResponse *)response {
@@ -166,16 +198,32 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
     self.expectedBytesCount = response.expectedContentLength;
     [self createBufferIfNeeded_:response];
     
+    if ([response isKindOfClass:[NSHTTPURLResponse class]]) {
+        // Cached destination is gone (other errors could be transient)
+        NSInteger statusCode = [(NSHTTPURLResponse *)response statusCode];
+        if (statusCode == 404 || statusCode == 410) {
+            [self invalidateRewrittenRedirect_];
+        }
+    }
+    
     if (self.responseHandler) self.responseHandler(response);
+    
+    if (self.operationResponseHandler_) {
+        self.operationResponseHandler_(response);
+    }
 }
 
 - (NSURLRequest *)willSendRequest:(NSURLRequest *)request redirectResponse:(NSURLResponse *)redirectResponse
 {
+    NSURLRequest *actualRequest = request;
     if (self.redirectHandler) {
-        return self.redirectHandler(request, redirectResponse);
+        actualRequest = self.redirectHandler(request, redirectResponse);
     }
     
-    return request;
+    // Only what handler accepted is remembered
+    [self recordRedirectToRequest_:actualRequest redirectResponse:redirectResponse];
+    
+    return actualRequest;
 }
 
 - (void)didFinishLoading {    
@@ -229,6 +277,7 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
 - (void)nullifyInternalURLConnection_ {
     [self.connection_ cancel];
     self.connection_ = nil;
+    self.rewrittenURL_ = nil;
     
     self.receivedBytesCount = 0;
     self.expectedBytesCount = NSURLResponseUnknownLength;
@@ -253,6 +302,80 @@ float const MUKURLConnectionUnknownQuota = -1.0f;
     }
 }
 
+#pragma mark - Private: Redirects
+
+- (NSURLRequest *)requestRewrittenWithRedirectCache_ {
+    NSURLRequest *request = self.request;
+    self.rewrittenURL_ = nil;
+    
+    if (self.redirectCache == nil) {
+        return request;
+    }
+    
+    // Other methods could be changed by a redirect
+    NSString *method = [request HTTPMethod];
+    if (!([method isEqualToString:@"GET"] || [method isEqualToString:@"HEAD"])) {
+        return request;
+    }
+    
+    NSURL *redirectedURL = [self.redirectCache redirectedURLForURL:[request URL]];
+    if (redirectedURL == nil) {
+        return request;
+    }
+    
+    NSMutableURLRequest *redirectedRequest = [request mutableCopy];
+    [redirectedRequest setURL:redirectedURL];
+    
+    // Cached rewrite looks like the redirect it replaces
+    NSDictionary *headerFields = @{ @"Location" : [redirectedURL absoluteString] };
+    NSHTTPURLResponse *redirectResponse = [[NSHTTPURLResponse alloc] initWithURL:[request URL] statusCode:301 HTTPVersion:@"HTTP/1.1" headerFields:headerFields];
+    
+    /*
+     Handler is asked directly: its answer only applies to this connection, so
+     it is not recorded like a real redirect
+     */
+    NSURLRequest *actualRequest = redirectedRequest;
+    if (self.redirectHandler) {
+        actualRequest = self.redirectHandler(redirectedRequest, redirectResponse);
+    }
+    
+    if (actualRequest == nil) {
+        // Vetoed: let server decide
+        return request;
+    }
+    
+    self.rewrittenURL_ = [request URL];
+    return actualRequest;
+}
+
+- (void)recordRedirectToRequest_:(NSURLRequest *)request redirectResponse:(NSURLResponse *)redirectResponse
+{
+    if (self.redirectCache == nil || ![redirectResponse isKindOfClass:[NSHTTPURLResponse class]])
+    {
+        return;
+    }
+    
+    NSInteger statusCode = [(NSHTTPURLResponse *)redirectResponse statusCode];
+    if (statusCode != 301 && statusCode != 308) {
+        return;
+    }
+    
+    if (request) {
+        [self.redirectCache setRedirectedURL:[request URL] forURL:[redirectResponse URL]];
+    }
+    else {
+        // App refused this destination: don't rewrite to it again
+        [self.redirectCache removeRedirectForURL:[redirectResponse URL]];
+    }
+}
+
+- (void)invalidateRewrittenRedirect_ {
+    if (self.rewrittenURL_) {
+        [self.redirectCache removeRedirectForURL:self.rewrittenURL_];
+        self.rewrittenURL_ = nil;
+    }
+}
+
 #pragma mark - Private: Background
 
 - (void)beginBackgroundTaskIfNeeded_ {
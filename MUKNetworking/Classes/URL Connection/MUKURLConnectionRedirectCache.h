@@ -0,0 +1,107 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import <Foundation/Foundation.h>
+
+/**
+ This class keeps a bounded table of permanent redirects, so connections 
+ could go straight to the final URL instead of paying a round trip per redirect.
+ 
+ Assign a cache to [MUKURLConnection redirectCache]: connection records every
+ `301` and `308` redirect it receives and it rewrites `GET` and `HEAD` requests
+ before [MUKURLConnection start] hits the network. Chains of cached redirects
+ are followed.
+ 
+ When table is full, least recently used redirect is dropped. Table is loaded
+ from path as cache is created and every change is saved to path on a private
+ serial dispatch queue, so redirects survive relaunches.
+ 
+ Cache is thread safe.
+ */
+@interface MUKURLConnectionRedirectCache : NSObject
+/** @name Initializers */
+/**
+ Designated initializer.
+ 
+ @param path Path of file where redirects are persisted. File is created if it
+ does not exist. Pass `nil` to keep redirects in memory only.
+ @return A new cache, with redirects found at path.
+ */
+- (id)initWithPath:(NSString *)path;
+
+/** @name Properties */
+/**
+ Path of file where redirects are persisted.
+ */
+@property (nonatomic, strong, readonly) NSString *path;
+/**
+ Maximum number of redirects in table.
+ 
+ Default is `256`. If you lower it, least recently used redirects are dropped.
+ */
+@property (nonatomic) NSUInteger capacity;
+
+/** @name Methods */
+/**
+ Cache shared by the whole process, persisted in application Caches directory.
+ @return Shared cache instance.
+ */
++ (MUKURLConnectionRedirectCache *)sharedCache;
+/**
+ Final URL of cached redirects starting from a URL.
+ 
+ @param URL Requested URL.
+ @return URL which request should be sent to, or `nil` if URL is not 
+ redirected (or if cached redirects form a loop).
+ */
+- (NSURL *)redirectedURLForURL:(NSURL *)URL;
+/**
+ Stores a permanent redirect.
+ 
+ @param redirectedURL URL which replaces `URL`.
+ @param URL Redirected URL.
+ */
+- (void)setRedirectedURL:(NSURL *)redirectedURL forURL:(NSURL *)URL;
+/**
+ Removes redirect which starts from a URL, if any.
+ 
+ @param URL Redirected URL.
+ */
+- (void)removeRedirectForURL:(NSURL *)URL;
+/**
+ Removes every redirect.
+ */
+- (void)removeAllRedirects;
+/**
+ Number of cached redirects.
+ @return Number of redirects in table.
+ */
+- (NSUInteger)count;
+/**
+ Writes pending changes to path and waits for them to be saved.
+ @return `YES` if table has been saved (or if there is no path).
+ */
+- (BOOL)synchronize;
+@end
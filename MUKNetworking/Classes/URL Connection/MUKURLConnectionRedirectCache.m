@@ -0,0 +1,298 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#import "MUKURLConnectionRedirectCache.h"
+
+static NSUInteger const kDefaultCapacity = 256;
+
+@interface MUKURLConnectionRedirectCache ()
+@property (nonatomic, strong, readwrite) NSString *path;
+
+// Synchronized on self
+@property (nonatomic, strong) NSMutableDictionary *redirects_;
+@property (nonatomic, strong) NSMutableArray *sourceURLStrings_; // LRU first
+
+#if OS_OBJECT_USE_OBJC
+@property (nonatomic, strong) dispatch_queue_t fileQueue_;
+#else
+@property (nonatomic, assign) dispatch_queue_t fileQueue_;
+#endif
+
+- (void)load_;
+- (NSArray *)snapshot_;
+- (BOOL)writeSnapshot_:(NSArray *)snapshot;
+- (void)saveAsync_;
+- (void)touchSourceURLString_:(NSString *)sourceURLString;
+- (void)evictIfNeeded_;
+@end
+
+@implementation MUKURLConnectionRedirectCache
+@synthesize path = path_;
+@synthesize capacity = capacity_;
+@synthesize redirects_ = redirects__;
+@synthesize sourceURLStrings_ = sourceURLStrings__;
+@synthesize fileQueue_ = fileQueue__;
+
++ (MUKURLConnectionRedirectCache *)sharedCache {
+    static MUKURLConnectionRedirectCache *sharedCache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSString *cachesPath = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) lastObject];
+        NSString *path = [cachesPath stringByAppendingPathComponent:@"MUKURLConnectionRedirectCache.plist"];
+        sharedCache = [[MUKURLConnectionRedirectCache alloc] initWithPath:path];
+    });
+    
+    return sharedCache;
+}
+
+- (id)init {
+    self = [self initWithPath:nil];
+    return self;
+}
+
+- (id)initWithPath:(NSString *)path {
+    self = [super init];
+    if (self) {
+        self.path = path;
+        capacity_ = kDefaultCapacity;
+        self.redirects_ = [[NSMutableDictionary alloc] init];
+        self.sourceURLStrings_ = [[NSMutableArray alloc] init];
+        self.fileQueue_ = dispatch_queue_create("it.melive.mukit.muknetworking.redirectcache", DISPATCH_QUEUE_SERIAL);
+        
+        // Table is small: load it now, so first lookups are right
+        [self load_];
+    }
+    return self;
+}
+
+- (void)dealloc {
+#if !OS_OBJECT_USE_OBJC
+    if (fileQueue__) {
+        dispatch_release(fileQueue__);
+    }
+#endif
+}
+
+#pragma mark - Methods
+
+- (NSURL *)redirectedURLForURL:(NSURL *)URL {
+    NSString *URLString = [URL absoluteString];
+    if (URLString == nil) {
+        return nil;
+    }
+    
+    @synchronized(self) {
+        NSString *redirectedURLString = nil;
+        NSMutableSet *visitedURLStrings = [NSMutableSet set];
+        
+        // Follow chain
+        NSString *nextURLString = self.redirects_[URLString];
+        while (nextURLString) {
+            if ([visitedURLStrings containsObject:nextURLString] ||
+                [nextURLString isEqualToString:URLString])
+            {
+                // Loop: go to network and let server decide
+                return nil;
+            }
+            
+            [visitedURLStrings addObject:nextURLString];
+            redirectedURLString = nextURLString;
+            nextURLString = self.redirects_[nextURLString];
+        }
+        
+        if (redirectedURLString == nil) {
+            return nil;
+        }
+        
+        // Not persisted: usage order is a hint
+        [self touchSourceURLString_:URLString];
+        
+        return [NSURL URLWithString:redirectedURLString];
+    }
+}
+
+- (void)setRedirectedURL:(NSURL *)redirectedURL forURL:(NSURL *)URL {
+    NSString *URLString = [URL absoluteString];
+    NSString *redirectedURLString = [redirectedURL absoluteString];
+    
+    if (URLString == nil || redirectedURLString == nil ||
+        [URLString isEqualToString:redirectedURLString])
+    {
+        return;
+    }
+    
+    @synchronized(self) {
+        BOOL changed = ![self.redirects_[URLString] isEqualToString:redirectedURLString];
+        
+        self.redirects_[URLString] = redirectedURLString;
+        [self touchSourceURLString_:URLString];
+        [self evictIfNeeded_];
+        
+        if (!changed) {
+            return;
+        }
+    }
+    
+    [self saveAsync_];
+}
+
+- (void)removeRedirectForURL:(NSURL *)URL {
+    NSString *URLString = [URL absoluteString];
+    if (URLString == nil) {
+        return;
+    }
+    
+    @synchronized(self) {
+        if (self.redirects_[URLString] == nil) {
+            return;
+        }
+        
+        [self.redirects_ removeObjectForKey:URLString];
+        [self.sourceURLStrings_ removeObject:URLString];
+    }
+    
+    [self saveAsync_];
+}
+
+- (void)removeAllRedirects {
+    @synchronized(self) {
+        [self.redirects_ removeAllObjects];
+        [self.sourceURLStrings_ removeAllObjects];
+    }
+    
+    [self saveAsync_];
+}
+
+- (NSUInteger)count {
+    @synchronized(self) {
+        return [self.redirects_ count];
+    }
+}
+
+- (BOOL)synchronize {
+    if (self.path == nil) {
+        return YES;
+    }
+    
+    NSArray *snapshot = [self snapshot_];
+    
+    __block BOOL success;
+    dispatch_sync(self.fileQueue_, ^{
+        success = [self writeSnapshot_:snapshot];
+    });
+    
+    return success;
+}
+
+#pragma mark - Accessors
+
+- (void)setCapacity:(NSUInteger)capacity {
+    BOOL evicted;
+    
+    @synchronized(self) {
+        capacity_ = capacity;
+        
+        NSUInteger count = [self.redirects_ count];
+        [self evictIfNeeded_];
+        evicted = ([self.redirects_ count] != count);
+    }
+    
+    if (evicted) {
+        [self saveAsync_];
+    }
+}
+
+#pragma mark - Private
+
+- (void)load_ {
+    if (self.path == nil) {
+        return;
+    }
+    
+    // Pairs of source and destination, least recently used first
+    NSArray *pairs = [[NSArray alloc] initWithContentsOfFile:self.path];
+    
+    for (NSArray *pair in pairs) {
+        if (![pair isKindOfClass:[NSArray class]] || [pair count] != 2) {
+            continue;
+        }
+        
+        NSString *URLString = pair[0];
+        self.redirects_[URLString] = pair[1];
+        [self.sourceURLStrings_ removeObject:URLString];
+        [self.sourceURLStrings_ addObject:URLString];
+    }
+    
+    [self evictIfNeeded_];
+}
+
+- (NSArray *)snapshot_ {
+    @synchronized(self) {
+        NSMutableArray *pairs = [[NSMutableArray alloc] initWithCapacity:[self.sourceURLStrings_ count]];
+        
+        for (NSString *URLString in self.sourceURLStrings_) {
+            [pairs addObject:@[URLString, self.redirects_[URLString]]];
+        }
+        
+        return pairs;
+    }
+}
+
+- (BOOL)writeSnapshot_:(NSArray *)snapshot {
+    // Called on file queue
+    NSString *directory = [self.path stringByDeletingLastPathComponent];
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil];
+    
+    return [snapshot writeToFile:self.path atomically:YES];
+}
+
+- (void)saveAsync_ {
+    if (self.path == nil) {
+        return;
+    }
+    
+    // Capture table on caller thread, so writes are saved in order
+    NSArray *snapshot = [self snapshot_];
+    dispatch_async(self.fileQueue_, ^{
+        [self writeSnapshot_:snapshot];
+    });
+}
+
+- (void)touchSourceURLString_:(NSString *)sourceURLString {
+    // Called synchronized
+    [self.sourceURLStrings_ removeObject:sourceURLString];
+    [self.sourceURLStrings_ addObject:sourceURLString];
+}
+
+- (void)evictIfNeeded_ {
+    // Called synchronized
+    while ([self.sourceURLStrings_ count] > self.capacity) {
+        NSString *URLString = self.sourceURLStrings_[0];
+        [self.sourceURLStrings_ removeObjectAtIndex:0];
+        [self.redirects_ removeObjectForKey:URLString];
+    }
+}
+
+@end
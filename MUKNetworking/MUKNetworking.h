@@ -1,2 +1,5 @@
 #import <MUKNetworking/MUKURLConnection.h>
-#import <MUKNetworking/MUKURLConnectionQueue.h>
\ No newline at end of file
+#import <MUKNetworking/MUKURLConnectionRedirectCache.h>
+#import <MUKNetworking/MUKURLConnectionQueue.h>
+#import <MUKNetworking/MUKURLConnectionQueueJournal.h>
+#import <MUKNetworking/MUKURLConnectionScheduler.h>
\ No newline at end of file
@@ -0,0 +1,295 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#import "MUKURLConnectionQueueJournalTests.h"
+#import "MUKURLConnectionQueue.h"
+#import "MUKURLConnectionQueueJournal.h"
+#import "MUKURLConnectionQueueJournal_Queue.h"
+
+#define kTimeout    2.0
+
+@interface MUKURLConnectionQueueJournalTests ()
+@property (nonatomic, strong) NSString *journalPath_;
+@end
+
+@implementation MUKURLConnectionQueueJournalTests
+@synthesize journalPath_;
+
+- (void)setUp {
+    [super setUp];
+    self.journalPath_ = [NSTemporaryDirectory() stringByAppendingPathComponent:@"MUKURLConnectionQueueJournalTests.journal"];
+    [[NSFileManager defaultManager] removeItemAtPath:self.journalPath_ error:nil];
+}
+
+- (void)tearDown {
+    [[NSFileManager defaultManager] removeItemAtPath:self.journalPath_ error:nil];
+    [super tearDown];
+}
+
+- (void)testRecovery {
+    NSURLRequest *request1 = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com/1"]];
+    NSURLRequest *request2 = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com/2"]];
+    MUKURLConnection *connection1 = [[MUKURLConnection alloc] initWithRequest:request1];
+    connection1.userInfo = @"first";
+    connection1.runsInBackground = YES;
+    MUKURLConnection *connection2 = [[MUKURLConnection alloc] initWithRequest:request2];
+    connection2.userInfo = @"second";
+    connection2.usesBuffer = NO;
+    connection2.deadline = [NSDate dateWithTimeIntervalSinceNow:60.0];
+    
+    MUKURLConnectionQueueJournal *journal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    
+    // Connections never start: like a terminated process
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.suspended = YES;
+    queue.journal = journal;
+    [queue addConnections:@[connection1, connection2]];
+    
+    // Wait for journal to be written
+    STAssertEquals([[journal pendingConnections] count], (NSUInteger)2, nil);
+    
+    // Relaunch
+    MUKURLConnectionQueueJournal *relaunchedJournal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    NSArray *recoveredConnections = [relaunchedJournal pendingConnections];
+    STAssertEquals([recoveredConnections count], (NSUInteger)2, @"Both connections recovered");
+    
+    MUKURLConnection *recoveredConnection1 = recoveredConnections[0];
+    STAssertEqualObjects([recoveredConnection1.request URL], [request1 URL], @"Same order");
+    STAssertEqualObjects(recoveredConnection1.userInfo, connection1.userInfo, nil);
+    STAssertTrue(recoveredConnection1.runsInBackground, nil);
+    STAssertNil(recoveredConnection1.deadline, nil);
+    
+    MUKURLConnection *recoveredConnection2 = recoveredConnections[1];
+    STAssertEqualObjects([recoveredConnection2.request URL], [request2 URL], @"Same order");
+    STAssertEqualObjects(recoveredConnection2.userInfo, connection2.userInfo, nil);
+    STAssertFalse(recoveredConnection2.usesBuffer, nil);
+    STAssertEqualObjects(recoveredConnection2.deadline, connection2.deadline, nil);
+    
+    [queue cancelAllConnections];
+    queue.suspended = NO;
+}
+
+- (void)testUnarchivableUserInfo {
+    NSURLRequest *request1 = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com/1"]];
+    NSURLRequest *request2 = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com/2"]];
+    MUKURLConnection *connection1 = [[MUKURLConnection alloc] initWithRequest:request1];
+    // Top-level object conforms to NSCoding, its content does not
+    connection1.userInfo = @{ @"object" : [[NSObject alloc] init] };
+    MUKURLConnection *connection2 = [[MUKURLConnection alloc] initWithRequest:request2];
+    connection2.userInfo = @"second";
+    
+    MUKURLConnectionQueueJournal *journal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.suspended = YES;
+    queue.journal = journal;
+    [queue addConnections:@[connection1, connection2]];
+    
+    // Compaction archives every pending record again
+    [journal compact];
+    STAssertEquals([[journal pendingConnections] count], (NSUInteger)2, nil);
+    
+    // Relaunch
+    MUKURLConnectionQueueJournal *relaunchedJournal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    NSArray *recoveredConnections = [relaunchedJournal pendingConnections];
+    STAssertEquals([recoveredConnections count], (NSUInteger)2, @"Both connections recovered");
+    
+    MUKURLConnection *recoveredConnection1 = recoveredConnections[0];
+    STAssertEqualObjects([recoveredConnection1.request URL], [request1 URL], nil);
+    STAssertNil(recoveredConnection1.userInfo, @"userInfo which can not be archived is dropped");
+    
+    MUKURLConnection *recoveredConnection2 = recoveredConnections[1];
+    STAssertEqualObjects(recoveredConnection2.userInfo, connection2.userInfo, nil);
+    
+    [queue cancelAllConnections];
+    queue.suspended = NO;
+}
+
+- (void)testCompletionRemovesRecords {
+    NSURLRequest *request = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    MUKURLConnection *connection1 = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *connection2 = [[MUKURLConnection alloc] initWithRequest:request];
+    NSArray *connections = @[connection1, connection2];
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueueJournal *journal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumConcurrentConnections = 1;
+    queue.journal = journal;
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    [queue addConnections:connections];
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEquals([[journal pendingConnections] count], (NSUInteger)0, @"Completed connections are not pending");
+    
+    MUKURLConnectionQueueJournal *relaunchedJournal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    STAssertEquals([[relaunchedJournal pendingConnections] count], (NSUInteger)0, @"Nothing to recover");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testRecoveryEnqueueing {
+    NSURLRequest *request = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:request];
+    
+    MUKURLConnectionQueueJournal *journal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.suspended = YES;
+    queue.journal = journal;
+    [queue addConnection:connection];
+    [journal pendingConnections];
+    
+    // Process terminated while last record was being written
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:self.journalPath_];
+    [fileHandle seekToEndOfFile];
+    [fileHandle writeData:[@"garbage" dataUsingEncoding:NSUTF8StringEncoding]];
+    [fileHandle closeFile];
+    
+    // Relaunch
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *relaunchedQueue = [[MUKURLConnectionQueue alloc] init];
+    relaunchedQueue.journal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    
+    __block BOOL completed = NO;
+    NSArray *recoveredConnections = [relaunchedQueue addJournaledConnectionsWithConfigurationHandler:^(MUKURLConnection *recoveredConnection)
+    {
+        recoveredConnection.completionHandler = ^(BOOL success, NSError *error) {
+            completed = success;
+        };
+    }];
+    STAssertEquals([recoveredConnections count], (NSUInteger)1, @"Garbage is ignored");
+    
+    BOOL done = [self waitForCompletion:&completed timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    [self unregisterTestURLProtocol];
+    [queue cancelAllConnections];
+    queue.suspended = NO;
+}
+
+- (void)testProgressRecovery {
+    NSURLRequest *request = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:request];
+    
+    [self registerTestURLProtocol];
+    NSMutableArray *chunks = [NSMutableArray array];
+    for (NSInteger i = 0; i < 5; i++) {
+        [chunks addObject:[NSMutableData dataWithLength:10]];
+    }
+    [MUKTestURLProtocol setChunksToProduce:chunks];
+    
+    MUKURLConnectionQueueJournal *journal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    journal.progressGranularity = 20;
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.journal = journal;
+    
+    // Relaunch while connection is running, like a terminated process
+    __block NSString *rangeAfterFirstChunk = @"none";
+    __block NSString *rangeAfterThirdChunk = nil;
+    __block NSString *rangeWithoutResume = @"none";
+    __weak MUKURLConnection *weakConnection = connection;
+    connection.progressHandler = ^(NSData *chunk, float quota) {
+        // Progress is recorded after this handler: wait for previous records
+        [journal pendingConnections];
+        
+        MUKURLConnectionQueueJournal *relaunchedJournal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+        relaunchedJournal.resumesPartialTransfers = YES;
+        MUKURLConnection *recoveredConnection = [[relaunchedJournal pendingConnections] lastObject];
+        NSString *range = [recoveredConnection.request valueForHTTPHeaderField:@"Range"];
+        
+        if (weakConnection.receivedBytesCount == 10) {
+            rangeAfterFirstChunk = range;
+        }
+        else if (weakConnection.receivedBytesCount == 30) {
+            rangeAfterThirdChunk = range;
+            
+            relaunchedJournal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+            recoveredConnection = [[relaunchedJournal pendingConnections] lastObject];
+            rangeWithoutResume = [recoveredConnection.request valueForHTTPHeaderField:@"Range"];
+        }
+    };
+    
+    __block BOOL completed = NO;
+    connection.completionHandler = ^(BOOL success, NSError *error) {
+        completed = YES;
+    };
+    
+    [queue addConnection:connection];
+    
+    BOOL done = [self waitForCompletion:&completed timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertNil(rangeAfterFirstChunk, @"Progress below granularity is not recorded");
+    STAssertEqualObjects(rangeAfterThirdChunk, @"bytes=20-", @"Last progress record is replayed");
+    STAssertNil(rangeWithoutResume, @"Range is requested only if journal resumes partial transfers");
+    
+    [self unregisterTestURLProtocol];
+}
+
+- (void)testAutomaticCompaction {
+    NSURLRequest *request = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    MUKURLConnection *pendingConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    
+    MUKURLConnectionQueueJournal *journal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    [journal recordConnection:pendingConnection];
+    [journal pendingConnections];
+    
+    unsigned long long recordSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:self.journalPath_ error:nil] fileSize];
+    
+    // Every completed connection leaves two stale records
+    for (NSInteger i = 0; i < 300; i++) {
+        MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:request];
+        [journal recordConnection:connection];
+        [journal recordCompletionOfConnection:connection];
+    }
+    [journal pendingConnections];
+    
+    unsigned long long fileSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:self.journalPath_ error:nil] fileSize];
+    STAssertTrue(fileSize < recordSize * 256, @"Stale records are dropped");
+    
+    // Relaunch
+    MUKURLConnectionQueueJournal *relaunchedJournal = [[MUKURLConnectionQueueJournal alloc] initWithPath:self.journalPath_];
+    NSArray *recoveredConnections = [relaunchedJournal pendingConnections];
+    STAssertEquals([recoveredConnections count], (NSUInteger)1, @"Pending connection survives compaction");
+    STAssertEqualObjects([[recoveredConnections[0] request] URL], [request URL], nil);
+}
+
+@end
@@ -25,6 +25,8 @@
 
 #import "MUKURLConnectionQueueTests.h"
 #import "MUKURLConnectionQueue.h"
+#import "MUKURLConnectionBatch_.h"
+#import <UIKit/UIKit.h>
 
 #define kTimeout    2.0
 
@@ -417,4 +419,906 @@
     STAssertEquals(count, [connections count], nil);
 }
 
+- (void)testDeadlineOrdering {
+    NSURLRequest *request = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    MUKURLConnection *connection1 = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *connection2 = [[MUKURLConnection alloc] initWithRequest:request];
+    connection2.deadline = [NSDate dateWithTimeIntervalSinceNow:kTimeout * 10.0];
+    MUKURLConnection *connection3 = [[MUKURLConnection alloc] initWithRequest:request];
+    connection3.deadline = [NSDate dateWithTimeIntervalSinceNow:kTimeout * 5.0];
+    NSArray *connections = @[connection1, connection2, connection3];
+    NSArray *expectedOrder = @[connection3, connection2, connection1];
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumConcurrentConnections = 1;
+    
+    NSMutableArray *startedConnections = [NSMutableArray array];
+    queue.connectionWillStartHandler = ^(MUKURLConnection *conn) {
+        [startedConnections addObject:conn];
+    };
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        STAssertFalse(cancelled, @"Not cancelled");
+        STAssertFalse(conn.deadlineExpired, @"Deadline met");
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    queue.suspended = YES;
+    [queue addConnections:connections];
+    queue.suspended = NO;
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEqualObjects(startedConnections, expectedOrder, @"Earliest deadline first, then FIFO");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionWillStartHandler = nil;
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testDeadlineExpiration {
+    NSURLRequest *request = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    MUKURLConnection *connection1 = [[MUKURLConnection alloc] initWithRequest:request];
+    connection1.deadline = [NSDate dateWithTimeIntervalSinceNow:0.3];
+    MUKURLConnection *connection2 = [[MUKURLConnection alloc] initWithRequest:request];
+    connection2.deadline = [NSDate dateWithTimeIntervalSinceNow:0.35];
+    NSArray *connections = @[connection1, connection2];
+    
+    // Transfer lasts longer than deadlines
+    NSData *firstChunk = [@"Hello" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    NSData *secondChunk = [@"World" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    NSArray *chunks = @[firstChunk, secondChunk];
+    
+    __block BOOL completionCalled = NO;
+    connection1.completionHandler = connection2.completionHandler = ^(BOOL success, NSError *error)
+    {
+        completionCalled = YES;
+    };
+    
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setChunksToProduce:chunks];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumConcurrentConnections = 1;
+    queue.minimumTimeToDeadline = 0.1;
+    
+    __block NSInteger willStartConnectionCount = 0;
+    queue.connectionWillStartHandler = ^(MUKURLConnection *conn) {
+        willStartConnectionCount++;
+    };
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        STAssertTrue(cancelled, @"Cancelled");
+        STAssertTrue(conn.deadlineExpired, @"Deadline expired");
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    [queue addConnections:connections];
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    // First is dropped while transferring, second while waiting in queue
+    STAssertEquals(willStartConnectionCount, (NSInteger)1, @"Only first connection started");
+    STAssertFalse(completionCalled, @"Dropped connections are not completed");
+    STAssertEquals((NSUInteger)0, [[queue connections] count], @"No more connections enqueued");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionWillStartHandler = nil;
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testBatchedCancellationDelivery {
+    NSURLRequest *request = [[NSURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    NSInteger const kConnectionsCount = 50;
+    NSMutableArray *connections = [[NSMutableArray alloc] initWithCapacity:kConnectionsCount];
+    for (NSInteger i = 0; i < kConnectionsCount; i++) {
+        [connections addObject:[[MUKURLConnection alloc] initWithRequest:request]];
+    }
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumConcurrentConnections = 1;
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        STAssertTrue(cancelled, @"Cancelled");
+        didFinishConnectionCount++;
+    };
+    
+    __block NSInteger batchesCount = 0;
+    __block NSInteger batchedConnectionsCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionsDidFinishHandler = ^(NSArray *finishedConnections, NSArray *cancelledConnections)
+    {
+        STAssertEqualObjects(finishedConnections, cancelledConnections, @"Every connection cancelled");
+        STAssertEquals(didFinishConnectionCount, batchedConnectionsCount + (NSInteger)[finishedConnections count], @"Single callbacks come first");
+        
+        batchesCount++;
+        batchedConnectionsCount += [finishedConnections count];
+        allConnectionsStopped = (batchedConnectionsCount == kConnectionsCount);
+    };
+    
+    queue.suspended = YES;
+    [queue addConnections:connections];
+    [queue cancelAllConnections];
+    queue.suspended = NO;
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEquals(didFinishConnectionCount, kConnectionsCount, nil);
+    STAssertTrue(batchesCount < kConnectionsCount, @"Completions coalesced (%i batches)", batchesCount);
+    STAssertEquals((NSUInteger)0, [[queue connections] count], @"No more connections enqueued");
+    
+    queue.connectionDidFinishHandler = nil;
+    queue.connectionsDidFinishHandler = nil;
+}
+
+- (void)testPrefetchUsesSpareCapacity {
+    NSURL *prefetchURL = [NSURL URLWithString:@"http://www.apple.com/prefetch"];
+    NSURL *URL1 = [NSURL URLWithString:@"http://www.apple.com/1"];
+    NSURL *URL2 = [NSURL URLWithString:@"http://www.apple.com/2"];
+    NSArray *connections = @[[[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:URL1]], [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:URL2]]];
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumConcurrentConnections = 1;
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        STAssertTrue([connections containsObject:conn], @"Prefetch is not notified");
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    queue.suspended = YES;
+    STAssertTrue([queue addPrefetchRequest:[NSURLRequest requestWithURL:prefetchURL]], nil);
+    [queue addConnections:connections];
+    STAssertEqualObjects([queue connections], connections, @"Prefetch is not listed");
+    queue.suspended = NO;
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    // Let prefetch go
+    BOOL neverDone = NO;
+    [self waitForCompletion:&neverDone timeout:kTimeout/2.0];
+    
+    NSArray *expectedURLs = @[URL1, URL2, prefetchURL];
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], expectedURLs, @"Prefetch after foreground connections");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testPrefetchPromotion {
+    NSURL *prefetchURL = [NSURL URLWithString:@"http://www.apple.com/prefetch"];
+    NSData *firstChunk = [@"Hello" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    NSData *secondChunk = [@"World" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    NSArray *chunks = @[firstChunk, secondChunk];
+    NSData *expectedData = [@"HelloWorld" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setChunksToProduce:chunks];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumConcurrentConnections = 1;
+    [queue addPrefetchRequest:[NSURLRequest requestWithURL:prefetchURL]];
+    
+    // One connection joins running prefetch, the other one comes later
+    MUKURLConnection *runningConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:prefetchURL]];
+    MUKURLConnection *bufferedConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:prefetchURL]];
+    
+    __weak MUKURLConnection *weakRunningConnection = runningConnection;
+    __block BOOL runningCompletionDone = NO;
+    runningConnection.completionHandler = ^(BOOL success, NSError *error) {
+        STAssertTrue(success, nil);
+        STAssertEqualObjects([weakRunningConnection bufferedData], expectedData, @"Whole data fed by prefetch");
+        runningCompletionDone = YES;
+    };
+    
+    __weak MUKURLConnection *weakBufferedConnection = bufferedConnection;
+    __block BOOL bufferedCompletionDone = NO;
+    bufferedConnection.completionHandler = ^(BOOL success, NSError *error) {
+        STAssertTrue(success, nil);
+        STAssertEqualObjects([weakBufferedConnection bufferedData], expectedData, @"Whole data replayed");
+        bufferedCompletionDone = YES;
+    };
+    
+    // Wait for first chunk
+    BOOL neverDone = NO;
+    [self waitForCompletion:&neverDone timeout:0.1];
+    [queue addConnection:runningConnection];
+    
+    BOOL done = [self waitForCompletion:&runningCompletionDone timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    // Running prefetch has been promoted: its data is not kept
+    [queue addConnection:bufferedConnection];
+    done = [self waitForCompletion:&bufferedCompletionDone timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)2, @"Promoted prefetch fed only first connection");
+    
+    // A completed prefetch feeds a connection without network
+    [queue addPrefetchRequest:[NSURLRequest requestWithURL:prefetchURL]];
+    [self waitForCompletion:&neverDone timeout:kTimeout/2.0];
+    
+    bufferedCompletionDone = NO;
+    bufferedConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:prefetchURL]];
+    bufferedConnection.completionHandler = ^(BOOL success, NSError *error) {
+        STAssertTrue(success, nil);
+        bufferedCompletionDone = YES;
+    };
+    [queue addConnection:bufferedConnection];
+    
+    done = [self waitForCompletion:&bufferedCompletionDone timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)3, @"Buffered prefetch replayed");
+    
+    [self unregisterTestURLProtocol];
+}
+
+- (void)testPrefetchMemoryPressure {
+    NSURL *prefetchURL = [NSURL URLWithString:@"http://www.apple.com/prefetch"];
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.suspended = YES;
+    [queue addPrefetchRequest:[NSURLRequest requestWithURL:prefetchURL]];
+    
+    [[NSNotificationCenter defaultCenter] postNotificationName:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+    queue.suspended = NO;
+    
+    BOOL neverDone = NO;
+    [self waitForCompletion:&neverDone timeout:kTimeout/2.0];
+    
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)0, @"Pending prefetch shed");
+    
+    [self unregisterTestURLProtocol];
+}
+
+- (void)testPrefetchRunningCancellation {
+    NSURL *prefetchURL = [NSURL URLWithString:@"http://www.apple.com/prefetch"];
+    NSData *chunk = [@"Hello" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setChunksToProduce:@[chunk, chunk, chunk]];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    [queue addPrefetchRequest:[NSURLRequest requestWithURL:prefetchURL]];
+    
+    // Wait for prefetch to be transferring
+    BOOL neverDone = NO;
+    [self waitForCompletion:&neverDone timeout:0.1];
+    [[NSNotificationCenter defaultCenter] postNotificationName:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+    
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:prefetchURL]];
+    __block BOOL completed = NO;
+    connection.completionHandler = ^(BOOL success, NSError *error) {
+        STAssertTrue(success, nil);
+        completed = YES;
+    };
+    [queue addConnection:connection];
+    
+    BOOL done = [self waitForCompletion:&completed timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    NSArray *expectedURLs = @[prefetchURL, prefetchURL];
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], expectedURLs, @"Running prefetch shed, so connection performs its own transfer");
+    
+    [self unregisterTestURLProtocol];
+}
+
+- (void)testPrefetchMatching {
+    NSURL *prefetchURL = [NSURL URLWithString:@"http://www.apple.com/prefetch"];
+    
+    NSMutableURLRequest *prefetchRequest = [[NSMutableURLRequest alloc] initWithURL:prefetchURL];
+    [prefetchRequest setValue:@"application/json" forHTTPHeaderField:@"Accept"];
+    
+    NSMutableURLRequest *otherHeadersRequest = [prefetchRequest mutableCopy];
+    [otherHeadersRequest setValue:@"text/html" forHTTPHeaderField:@"Accept"];
+    
+    NSMutableURLRequest *postRequest = [prefetchRequest mutableCopy];
+    [postRequest setHTTPMethod:@"POST"];
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    STAssertFalse([queue addPrefetchRequest:postRequest], @"Only bodyless GET requests are prefetched");
+    STAssertTrue([queue addPrefetchRequest:prefetchRequest], nil);
+    
+    // Let prefetch complete
+    BOOL neverDone = NO;
+    [self waitForCompletion:&neverDone timeout:kTimeout/2.0];
+    
+    NSArray *connections = @[[[MUKURLConnection alloc] initWithRequest:[prefetchRequest copy]], [[MUKURLConnection alloc] initWithRequest:otherHeadersRequest], [[MUKURLConnection alloc] initWithRequest:postRequest]];
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    [queue addConnections:connections];
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)3, @"Only a GET with same header fields is fed by prefetch");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testPrefetchedDataBounds {
+    NSURL *URL1 = [NSURL URLWithString:@"http://www.apple.com/1"];
+    NSURL *URL2 = [NSURL URLWithString:@"http://www.apple.com/2"];
+    NSURL *URL3 = [NSURL URLWithString:@"http://www.apple.com/3"];
+    NSData *chunk = [@"Hello" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setChunksToProduce:@[chunk]];
+    
+    // Room for two prefetches
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.prefetchedDataCapacity = [chunk length] * 2;
+    
+    BOOL neverDone = NO;
+    for (NSURL *URL in @[URL1, URL2, URL3]) {
+        [queue addPrefetchRequest:[NSURLRequest requestWithURL:URL]];
+        [self waitForCompletion:&neverDone timeout:kTimeout/4.0];
+    }
+    
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)3, nil);
+    
+    __block BOOL completed = NO;
+    void (^completionHandler)(BOOL, NSError *) = ^(BOOL success, NSError *error) {
+        STAssertTrue(success, nil);
+        completed = YES;
+    };
+    
+    // Most recent prefetch is still there
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:URL3]];
+    connection.completionHandler = completionHandler;
+    [queue addConnection:connection];
+    
+    BOOL done = [self waitForCompletion:&completed timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)3, @"Recent prefetch is replayed");
+    
+    // Oldest prefetch has been discarded to make room
+    completed = NO;
+    connection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:URL1]];
+    connection.completionHandler = completionHandler;
+    [queue addConnection:connection];
+    
+    done = [self waitForCompletion:&completed timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    STAssertEqualObjects([[MUKTestURLProtocol loadedURLs] lastObject], URL1, @"Oldest prefetch is discarded when capacity is exceeded");
+    
+    // Stale prefetch is not fed
+    queue.prefetchedDataLifetime = kTimeout/8.0;
+    [self waitForCompletion:&neverDone timeout:kTimeout/4.0];
+    
+    completed = NO;
+    connection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:URL2]];
+    connection.completionHandler = completionHandler;
+    [queue addConnection:connection];
+    
+    done = [self waitForCompletion:&completed timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)5, nil);
+    STAssertEqualObjects([[MUKTestURLProtocol loadedURLs] lastObject], URL2, @"Expired prefetch is discarded");
+    
+    [self unregisterTestURLProtocol];
+}
+
+- (void)testBatching {
+    NSURL *URL1 = [NSURL URLWithString:@"http://www.apple.com/1"];
+    NSURL *URL2 = [NSURL URLWithString:@"http://www.apple.com/2?q=x"];
+    NSURL *batchURL = [NSURL URLWithString:@"http://www.apple.com/batch"];
+    
+    MUKURLConnection *connection1 = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:URL1]];
+    MUKURLConnection *connection2 = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:URL2]];
+    NSArray *connections = @[connection1, connection2];
+    
+    // Parts in reverse order: they are matched by Content-ID
+    NSString *body = @"--b\r\n"
+    "Content-Type: application/http\r\n"
+    "Content-ID: <response-item-1>\r\n\r\n"
+    "HTTP/1.1 404 Not Found\r\n"
+    "Content-Type: text/plain\r\n\r\n"
+    "World\r\n"
+    "--b\r\n"
+    "Content-Type: application/http\r\n"
+    "Content-ID: <response-item-0>\r\n\r\n"
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/plain\r\n\r\n"
+    "Hello\r\n"
+    "--b--\r\n";
+    
+    NSHTTPURLResponse *batchResponse = [[NSHTTPURLResponse alloc] initWithURL:batchURL statusCode:200 HTTPVersion:@"HTTP/1.1" headerFields:@{ @"Content-Type" : @"multipart/mixed; boundary=b" }];
+    
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setResponseToProduce:batchResponse];
+    [MUKTestURLProtocol setChunksToProduce:@[[body dataUsingEncoding:NSUTF8StringEncoding]]];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.batchEndpointPath = @"/batch";
+    
+    NSMutableDictionary *statusCodes = [NSMutableDictionary dictionary];
+    __block NSInteger completionCount = 0;
+    for (MUKURLConnection *connection in connections) {
+        __weak MUKURLConnection *weakConnection = connection;
+        
+        connection.responseHandler = ^(NSURLResponse *response) {
+            STAssertEqualObjects([response URL], [weakConnection.request URL], @"Part response carries connection URL");
+            statusCodes[[response URL]] = @([(NSHTTPURLResponse *)response statusCode]);
+        };
+        
+        connection.completionHandler = ^(BOOL success, NSError *error) {
+            STAssertTrue(success, nil);
+            completionCount++;
+        };
+    }
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        STAssertTrue([connections containsObject:conn], @"Batch is not notified");
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    [queue addConnections:connections];
+    STAssertEqualObjects([queue connections], connections, @"Batch is not listed");
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], @[batchURL], @"One round trip");
+    STAssertEquals(completionCount, (NSInteger)2, nil);
+    STAssertEqualObjects(statusCodes[URL1], @200, @"Part matched by Content-ID");
+    STAssertEqualObjects(statusCodes[URL2], @404, @"Part matched by Content-ID");
+    STAssertEqualObjects([connection1 bufferedData], [@"Hello" dataUsingEncoding:NSUTF8StringEncoding], nil);
+    STAssertEqualObjects([connection2 bufferedData], [@"World" dataUsingEncoding:NSUTF8StringEncoding], nil);
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testBatchingRequestBodies {
+    NSURL *batchURL = [NSURL URLWithString:@"http://www.apple.com/batch"];
+    
+    NSMutableURLRequest *postRequest = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:@"http://www.apple.com/1"]];
+    [postRequest setHTTPMethod:@"POST"];
+    [postRequest setHTTPBody:[@"Hello" dataUsingEncoding:NSUTF8StringEncoding]];
+    [postRequest setValue:@"99" forHTTPHeaderField:@"Content-Length"];
+    NSURLRequest *getRequest = [NSURLRequest requestWithURL:[NSURL URLWithString:@"http://www.apple.com/2"]];
+    
+    NSURLRequest *batchRequest = [MUKURLConnectionBatch_ newBatchRequestWithRequests:@[postRequest, getRequest] endpointURL:batchURL];
+    NSString *batchBody = [[NSString alloc] initWithData:[batchRequest HTTPBody] encoding:NSUTF8StringEncoding];
+    
+    STAssertTrue([batchBody rangeOfString:@"POST /1 HTTP/1.1\r\n"].location != NSNotFound, nil);
+    STAssertTrue([batchBody rangeOfString:@"Content-Length: 5\r\n\r\nHello\r\n--"].location != NSNotFound, @"Body is carried with its length");
+    STAssertTrue([batchBody rangeOfString:@"Content-Length: 99"].location == NSNotFound, @"Length of request is not copied");
+    
+    // Streams can not be copied into a part, even if handler approves them
+    NSMutableArray *connections = [NSMutableArray array];
+    for (NSString *path in @[@"/3", @"/4"]) {
+        NSMutableURLRequest *streamRequest = [[NSMutableURLRequest alloc] initWithURL:[NSURL URLWithString:path relativeToURL:batchURL]];
+        [streamRequest setHTTPMethod:@"POST"];
+        [streamRequest setHTTPBodyStream:[NSInputStream inputStreamWithData:[@"Hello" dataUsingEncoding:NSUTF8StringEncoding]]];
+        [connections addObject:[[MUKURLConnection alloc] initWithRequest:streamRequest]];
+    }
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.batchEndpointPath = @"/batch";
+    queue.shouldBatchConnectionHandler = ^(MUKURLConnection *connection) {
+        return YES;
+    };
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    [queue addConnections:connections];
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    NSArray *loadedURLs = [MUKTestURLProtocol loadedURLs];
+    STAssertEquals([loadedURLs count], (NSUInteger)2, @"Every connection performs its own transfer");
+    STAssertFalse([loadedURLs containsObject:batchURL], @"No batch");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+    queue.shouldBatchConnectionHandler = nil;
+}
+
+- (void)testBatchingFailureConcurrency {
+    NSURL *batchURL = [NSURL URLWithString:@"http://www.apple.com/batch"];
+    
+    NSMutableArray *connections = [NSMutableArray array];
+    for (NSString *path in @[@"/1", @"/2", @"/3"]) {
+        NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:path relativeToURL:batchURL]];
+        [connections addObject:[[MUKURLConnection alloc] initWithRequest:request]];
+    }
+    
+    // Batch fails, so every connection performs its own transfer
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setFailsImmediately:YES];
+    [MUKTestURLProtocol setErrorToProduce:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCannotConnectToHost userInfo:nil]];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.batchEndpointPath = @"/batch";
+    queue.maximumConcurrentConnections = 1;
+    
+    __block NSInteger peakActiveConnectionsCount = 0;
+    for (MUKURLConnection *connection in connections) {
+        connection.completionHandler = ^(BOOL success, NSError *error) {
+            NSInteger activeConnectionsCount = 0;
+            for (MUKURLConnection *conn in connections) {
+                if ([conn isActive]) activeConnectionsCount++;
+            }
+            
+            peakActiveConnectionsCount = MAX(peakActiveConnectionsCount, activeConnectionsCount);
+        };
+    }
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    [queue addConnections:connections];
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    NSArray *loadedURLs = [MUKTestURLProtocol loadedURLs];
+    STAssertEquals([loadedURLs count], (NSUInteger)4, @"Batch, then every connection by itself");
+    STAssertEqualObjects(loadedURLs[0], batchURL, nil);
+    STAssertEquals(peakActiveConnectionsCount, (NSInteger)1, @"Connections which fall back wait for a slot");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+    for (MUKURLConnection *connection in connections) {
+        connection.completionHandler = nil;
+    }
+}
+
+- (void)testDependencyEarlyStart {
+    NSURL *manifestURL = [NSURL URLWithString:@"http://www.apple.com/manifest"];
+    MUKURLConnection *manifestConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:manifestURL]];
+    MUKURLConnection *earlyConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:[NSURL URLWithString:@"http://www.apple.com/early"]]];
+    MUKURLConnection *lateConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:[NSURL URLWithString:@"http://www.apple.com/late"]]];
+    NSArray *connections = @[lateConnection, earlyConnection, manifestConnection];
+    
+    NSData *firstChunk = [@"Hello" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    NSData *secondChunk = [@"World" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setChunksToProduce:@[firstChunk, secondChunk]];
+    
+    __block BOOL manifestFinished = NO;
+    manifestConnection.completionHandler = ^(BOOL success, NSError *error) {
+        manifestFinished = YES;
+    };
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    [queue addDependency:manifestConnection toConnection:earlyConnection stage:MUKURLConnectionQueueDependencyStageResponse];
+    [queue addDependency:manifestConnection toConnection:lateConnection stage:MUKURLConnectionQueueDependencyStageFinish];
+    
+    NSMutableArray *startedConnections = [NSMutableArray array];
+    __block BOOL earlyStartedBeforeFinish = NO, lateStartedAfterFinish = NO;
+    queue.connectionWillStartHandler = ^(MUKURLConnection *conn) {
+        [startedConnections addObject:conn];
+        
+        if (conn == earlyConnection) {
+            earlyStartedBeforeFinish = !manifestFinished;
+        }
+        else if (conn == lateConnection) {
+            lateStartedAfterFinish = manifestFinished;
+        }
+    };
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        STAssertFalse(cancelled, nil);
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    [queue addConnections:connections];
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    NSArray *expectedConnections = @[manifestConnection, earlyConnection, lateConnection];
+    STAssertEqualObjects(startedConnections, expectedConnections, @"Dependencies first");
+    STAssertTrue(earlyStartedBeforeFinish, @"Response satisfies dependency");
+    STAssertTrue(lateStartedAfterFinish, @"Only completion satisfies dependency");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionWillStartHandler = nil;
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testDependencyCancellation {
+    NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    MUKURLConnection *rootConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *childConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *grandchildConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *independentConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    NSArray *connections = @[rootConnection, childConnection, grandchildConnection, independentConnection];
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    [queue addDependency:rootConnection toConnection:childConnection stage:MUKURLConnectionQueueDependencyStageResponse];
+    [queue addDependency:childConnection toConnection:grandchildConnection receivedBytesCount:1];
+    
+    NSMutableArray *cancelledConnections = [NSMutableArray array];
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        if (cancelled) {
+            [cancelledConnections addObject:conn];
+        }
+        
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == [connections count]);
+    };
+    
+    queue.suspended = YES;
+    [queue addConnections:connections];
+    [rootConnection cancel];
+    queue.suspended = NO;
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    NSArray *expectedConnections = @[rootConnection, childConnection, grandchildConnection];
+    STAssertEqualObjects(cancelledConnections, expectedConnections, @"Cancellation propagates down the graph");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testDependencyLateResolution {
+    NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:@"http://www.apple.com"]];
+    MUKURLConnection *finishedConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *cancelledConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    
+    NSMutableArray *cancelledConnections = [NSMutableArray array];
+    __block NSInteger expectedConnectionsCount = 2;
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        if (cancelled) {
+            [cancelledConnections addObject:conn];
+        }
+        
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == expectedConnectionsCount);
+    };
+    
+    queue.suspended = YES;
+    [queue addConnections:@[finishedConnection, cancelledConnection]];
+    [cancelledConnection cancel];
+    queue.suspended = NO;
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    // Dependencies on connections which already left the queue, or never entered it
+    MUKURLConnection *afterSuccessConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *afterCancellationConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *orphanConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    MUKURLConnection *neverEnqueuedConnection = [[MUKURLConnection alloc] initWithRequest:request];
+    
+    [queue addDependency:finishedConnection toConnection:afterSuccessConnection stage:MUKURLConnectionQueueDependencyStageFinish];
+    [queue addDependency:cancelledConnection toConnection:afterCancellationConnection stage:MUKURLConnectionQueueDependencyStageResponse];
+    [queue addDependency:neverEnqueuedConnection toConnection:orphanConnection stage:MUKURLConnectionQueueDependencyStageFinish];
+    
+    [cancelledConnections removeAllObjects];
+    expectedConnectionsCount = 3;
+    didFinishConnectionCount = 0;
+    allConnectionsStopped = NO;
+    [queue addConnections:@[afterSuccessConnection, afterCancellationConnection, orphanConnection]];
+    
+    done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout: dependent connections are stuck");
+    
+    STAssertEqualObjects(cancelledConnections, @[afterCancellationConnection], @"Only a dependency which did not succeed cancels");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testDeferralRidesForegroundTraffic {
+    NSURL *deferredURL1 = [NSURL URLWithString:@"http://www.apple.com/deferred1"];
+    NSURL *deferredURL2 = [NSURL URLWithString:@"http://www.apple.com/deferred2"];
+    NSURL *foregroundURL = [NSURL URLWithString:@"http://www.apple.com/foreground"];
+    
+    MUKURLConnection *deferredConnection1 = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:deferredURL1]];
+    deferredConnection1.deferrable = YES;
+    MUKURLConnection *deferredConnection2 = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:deferredURL2]];
+    deferredConnection2.deferrable = YES;
+    MUKURLConnection *foregroundConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:foregroundURL]];
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumConcurrentConnections = 1;
+    queue.maximumDeferralInterval = 60.0;
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == 3);
+    };
+    
+    [queue addConnections:@[deferredConnection1, deferredConnection2]];
+    STAssertEquals([[queue connections] count], (NSUInteger)2, @"Deferred connections are listed");
+    
+    BOOL neverDone = NO;
+    [self waitForCompletion:&neverDone timeout:kTimeout/4.0];
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)0, @"Deferred connections are held");
+    
+    [queue addConnection:foregroundConnection];
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    NSArray *expectedURLs = @[foregroundURL, deferredURL1, deferredURL2];
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], expectedURLs, @"Deferred connections released behind foreground one");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+}
+
+- (void)testDeferralSkipsUrgentConnections {
+    NSURL *urgentURL = [NSURL URLWithString:@"http://www.apple.com/urgent"];
+    NSURL *deferredURL = [NSURL URLWithString:@"http://www.apple.com/deferred"];
+    
+    MUKURLConnection *urgentConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:urgentURL]];
+    urgentConnection.deferrable = YES;
+    urgentConnection.deadline = [NSDate dateWithTimeIntervalSinceNow:kTimeout * 5.0];
+    MUKURLConnection *deferredConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:deferredURL]];
+    deferredConnection.deferrable = YES;
+    
+    [self registerTestURLProtocol];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumDeferralInterval = 60.0;
+    
+    // Window is measured with a clock far from deadlines' one
+    queue.currentDateHandler = ^{
+        return [NSDate dateWithTimeIntervalSinceReferenceDate:0.0];
+    };
+    
+    __block BOOL urgentCompleted = NO;
+    urgentConnection.completionHandler = ^(BOOL success, NSError *error) {
+        STAssertTrue(success, nil);
+        urgentCompleted = YES;
+    };
+    
+    __block BOOL deferredCompleted = NO;
+    deferredConnection.completionHandler = ^(BOOL success, NSError *error) {
+        deferredCompleted = YES;
+    };
+    
+    [queue addConnections:@[deferredConnection, urgentConnection]];
+    
+    BOOL done = [self waitForCompletion:&urgentCompleted timeout:kTimeout];
+    if (!done) STFail(@"Timeout: connection with a deadline inside window is held");
+    
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], @[urgentURL], @"Deferrable traffic does not wake deferred connections up");
+    
+    [queue releaseDeferredConnections];
+    done = [self waitForCompletion:&deferredCompleted timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    [self unregisterTestURLProtocol];
+    queue.currentDateHandler = nil;
+}
+
+- (void)testDeferralWindowExpiration {
+    NSURL *deferredURL1 = [NSURL URLWithString:@"http://www.apple.com/deferred1"];
+    NSURL *deferredURL2 = [NSURL URLWithString:@"http://www.apple.com/deferred2"];
+    
+    MUKURLConnection *deferredConnection1 = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:deferredURL1]];
+    deferredConnection1.deferrable = YES;
+    MUKURLConnection *deferredConnection2 = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:deferredURL2]];
+    deferredConnection2.deferrable = YES;
+    NSURL *deferredURL3 = [NSURL URLWithString:@"http://www.apple.com/deferred3"];
+    MUKURLConnection *deferredConnection3 = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:deferredURL3]];
+    deferredConnection3.deferrable = YES;
+    
+    [self registerTestURLProtocol];
+    
+    // Clock moves only when test says so
+    __block NSDate *now = [NSDate dateWithTimeIntervalSinceReferenceDate:0.0];
+    
+    MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+    queue.maximumDeferralInterval = 10.0;
+    queue.currentDateHandler = ^{
+        return now;
+    };
+    
+    __block NSInteger didFinishConnectionCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        STAssertFalse(cancelled, nil);
+        didFinishConnectionCount++;
+        allConnectionsStopped = (didFinishConnectionCount == 3);
+    };
+    
+    [queue addConnection:deferredConnection1];
+    
+    now = [now dateByAddingTimeInterval:5.0];
+    [queue addConnection:deferredConnection2];
+    
+    BOOL neverDone = NO;
+    [self waitForCompletion:&neverDone timeout:kTimeout/4.0];
+    STAssertEquals([[MUKTestURLProtocol loadedURLs] count], (NSUInteger)0, @"Window is still open");
+    
+    // Oldest connection has waited enough: everyone goes
+    now = [now dateByAddingTimeInterval:5.0];
+    [queue addConnection:deferredConnection3];
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout];
+    if (!done) STFail(@"Timeout");
+    
+    NSArray *expectedURLs = @[deferredURL1, deferredURL2, deferredURL3];
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], expectedURLs, @"Released in a burst");
+    
+    [self unregisterTestURLProtocol];
+    queue.connectionDidFinishHandler = nil;
+    queue.currentDateHandler = nil;
+}
+
 @end
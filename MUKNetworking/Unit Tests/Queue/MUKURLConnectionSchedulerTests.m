@@ -0,0 +1,242 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#import "MUKURLConnectionSchedulerTests.h"
+#import "MUKURLConnectionQueue.h"
+#import "MUKURLConnectionScheduler.h"
+#import "MUKTestURLProtocol.h"
+#import "MUKURLConnectionScheduler_Queue.h"
+#import "MUKURLConnectionQueue_Scheduler.h"
+
+#define kTimeout    2.0
+
+@interface MockScheduledQueue_ : MUKURLConnectionQueue
+@property (nonatomic) NSInteger waitingConnectionsCount, runningConnectionsCount;
+@end
+
+@implementation MockScheduledQueue_
+@synthesize waitingConnectionsCount, runningConnectionsCount;
+
+- (NSUInteger)scheduledConnectionsCount_ {
+    return self.runningConnectionsCount;
+}
+
+- (BOOL)hasWaitingConnections_ {
+    return (self.waitingConnectionsCount > 0);
+}
+
+- (BOOL)isBusy_ {
+    return (self.waitingConnectionsCount > 0 || self.runningConnectionsCount > 0);
+}
+
+- (void)admitScheduledOperations_ {
+    while (self.waitingConnectionsCount > 0 && [self.scheduler canAdmitConnectionInQueue:self speculative:NO])
+    {
+        self.waitingConnectionsCount--;
+        self.runningConnectionsCount++;
+    }
+}
+
+@end
+
+#pragma mark - 
+#pragma mark - 
+
+@implementation MUKURLConnectionSchedulerTests
+
+- (NSArray *)newConnectionsWithCount_:(NSInteger)count {
+    NSMutableArray *connections = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSInteger i = 0; i < count; i++) {
+        NSURL *URL = [NSURL URLWithString:[NSString stringWithFormat:@"http://www.apple.com/%i", i]];
+        [connections addObject:[[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:URL]]];
+    }
+    
+    return connections;
+}
+
+- (void)testGlobalCap {
+    NSData *firstChunk = [@"Hello" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    NSData *secondChunk = [@"World" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setChunksToProduce:@[firstChunk, secondChunk]];
+    
+    MUKURLConnectionScheduler *scheduler = [[MUKURLConnectionScheduler alloc] init];
+    scheduler.maximumConcurrentConnections = 2;
+    
+    NSInteger const kQueuesCount = 3, kConnectionsPerQueue = 2;
+    __block NSInteger runningCount = 0, maxRunningCount = 0, finishedCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    
+    NSMutableArray *queues = [NSMutableArray array];
+    for (NSInteger i = 0; i < kQueuesCount; i++) {
+        MUKURLConnectionQueue *queue = [[MUKURLConnectionQueue alloc] init];
+        queue.scheduler = scheduler;
+        
+        queue.connectionWillStartHandler = ^(MUKURLConnection *conn) {
+            runningCount++;
+            maxRunningCount = MAX(maxRunningCount, runningCount);
+        };
+        
+        queue.connectionDidFinishHandler = ^(MUKURLConnection *conn, BOOL cancelled)
+        {
+            STAssertFalse(cancelled, nil);
+            runningCount--;
+            finishedCount++;
+            allConnectionsStopped = (finishedCount == kQueuesCount * kConnectionsPerQueue);
+        };
+        
+        [queues addObject:queue];
+    }
+    
+    for (MUKURLConnectionQueue *queue in queues) {
+        [queue addConnections:[self newConnectionsWithCount_:kConnectionsPerQueue]];
+    }
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout * 2.0];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEquals(maxRunningCount, (NSInteger)2, @"Budget is bounded and fully used");
+    STAssertEquals([scheduler runningConnectionsCount], (NSInteger)0, nil);
+    
+    [self unregisterTestURLProtocol];
+    for (MUKURLConnectionQueue *queue in queues) {
+        queue.connectionWillStartHandler = nil;
+        queue.connectionDidFinishHandler = nil;
+    }
+}
+
+- (void)testIdleCapacityIsLent {
+    NSData *firstChunk = [@"Hello" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    NSData *secondChunk = [@"World" dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+    
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setChunksToProduce:@[firstChunk, secondChunk]];
+    
+    MUKURLConnectionScheduler *scheduler = [[MUKURLConnectionScheduler alloc] init];
+    scheduler.maximumConcurrentConnections = 2;
+    
+    MUKURLConnectionQueue *busyQueue = [[MUKURLConnectionQueue alloc] init];
+    busyQueue.scheduler = scheduler;
+    MUKURLConnectionQueue *lateQueue = [[MUKURLConnectionQueue alloc] init];
+    lateQueue.scheduler = scheduler;
+    
+    NSArray *busyConnections = [self newConnectionsWithCount_:3];
+    NSArray *lateConnections = [self newConnectionsWithCount_:1];
+    
+    __block NSInteger busyRunningCount = 0, maxBusyRunningCount = 0;
+    __block NSInteger busyRunningCountAtLateStart = -1;
+    __block NSInteger finishedCount = 0;
+    __block BOOL allConnectionsStopped = NO;
+    
+    void (^didFinishHandler)(MUKURLConnection *, BOOL) = ^(MUKURLConnection *conn, BOOL cancelled)
+    {
+        if ([busyConnections containsObject:conn]) {
+            busyRunningCount--;
+        }
+        
+        finishedCount++;
+        allConnectionsStopped = (finishedCount == (NSInteger)([busyConnections count] + [lateConnections count]));
+    };
+    
+    busyQueue.connectionWillStartHandler = ^(MUKURLConnection *conn) {
+        busyRunningCount++;
+        maxBusyRunningCount = MAX(maxBusyRunningCount, busyRunningCount);
+        STAssertTrue([scheduler runningConnectionsCount] <= 2, @"Budget is bounded");
+    };
+    busyQueue.connectionDidFinishHandler = didFinishHandler;
+    
+    lateQueue.connectionWillStartHandler = ^(MUKURLConnection *conn) {
+        busyRunningCountAtLateStart = busyRunningCount;
+    };
+    lateQueue.connectionDidFinishHandler = didFinishHandler;
+    
+    // Both queues have work, but only the first one is running
+    busyQueue.suspended = YES;
+    lateQueue.suspended = YES;
+    [busyQueue addConnections:busyConnections];
+    [lateQueue addConnections:lateConnections];
+    
+    busyQueue.suspended = NO;
+    lateQueue.suspended = NO;
+    
+    BOOL done = [self waitForCompletion:&allConnectionsStopped timeout:kTimeout * 2.0];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEquals(maxBusyRunningCount, (NSInteger)2, @"Idle share is lent to busy queue");
+    STAssertTrue(busyRunningCountAtLateStart >= 0 && busyRunningCountAtLateStart <= 1, @"Lent slot returns to its queue before busy queue refills");
+    
+    [self unregisterTestURLProtocol];
+    busyQueue.connectionWillStartHandler = nil;
+    busyQueue.connectionDidFinishHandler = nil;
+    lateQueue.connectionWillStartHandler = nil;
+    lateQueue.connectionDidFinishHandler = nil;
+}
+
+- (void)testWeightedShares {
+    MUKURLConnectionScheduler *scheduler = [[MUKURLConnectionScheduler alloc] init];
+    scheduler.maximumConcurrentConnections = 6;
+    
+    // Queues join scheduler with work, so they compete for budget
+    MockScheduledQueue_ *heavyQueue = [[MockScheduledQueue_ alloc] init];
+    heavyQueue.schedulerWeight = 2;
+    heavyQueue.waitingConnectionsCount = 10;
+    MockScheduledQueue_ *lightQueue = [[MockScheduledQueue_ alloc] init];
+    lightQueue.schedulerWeight = 1;
+    lightQueue.waitingConnectionsCount = 10;
+    
+    [scheduler updateQueue:heavyQueue];
+    [scheduler updateQueue:lightQueue];
+    heavyQueue.scheduler = scheduler;
+    lightQueue.scheduler = scheduler;
+    
+    STAssertEquals(heavyQueue.runningConnectionsCount, (NSInteger)4, @"Budget is split by weight");
+    STAssertEquals(lightQueue.runningConnectionsCount, (NSInteger)2, @"Budget is split by weight");
+    
+    // Freed slots go back to the queue which owns them
+    heavyQueue.runningConnectionsCount -= 2;
+    [scheduler scheduleQueues];
+    STAssertEquals(heavyQueue.runningConnectionsCount, (NSInteger)4, @"Heavy queue refills its share");
+    STAssertEquals(lightQueue.runningConnectionsCount, (NSInteger)2, @"Light queue does not take heavy queue share");
+    
+    lightQueue.runningConnectionsCount--;
+    [scheduler scheduleQueues];
+    STAssertEquals(heavyQueue.runningConnectionsCount, (NSInteger)4, @"Heavy queue does not take light queue share");
+    STAssertEquals(lightQueue.runningConnectionsCount, (NSInteger)2, @"Light queue refills its share");
+    
+    // Share of a queue with nothing to wait for is lent
+    lightQueue.waitingConnectionsCount = 0;
+    lightQueue.runningConnectionsCount = 0;
+    [scheduler scheduleQueues];
+    STAssertEquals(heavyQueue.runningConnectionsCount, (NSInteger)6, @"Idle share is lent");
+    
+    heavyQueue.waitingConnectionsCount = 0;
+    heavyQueue.runningConnectionsCount = 0;
+    heavyQueue.scheduler = nil;
+    lightQueue.scheduler = nil;
+}
+
+@end
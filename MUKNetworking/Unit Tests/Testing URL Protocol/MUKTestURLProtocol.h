@@ -44,6 +44,11 @@
  */
 + (void)setChunksToProduce:(NSArray *)chunksToProduce;
 
+/*
+ URLs of requests which have been loaded since last reset
+ */
++ (NSArray *)loadedURLs;
+
 /*
  Reset all parameters
  */
@@ -53,11 +53,22 @@ static NSArray *MUKTestURLProtocolChunksToProduce = nil;
     MUKTestURLProtocolChunksToProduce = chunksToProduce;
 }
 
+static NSMutableArray *MUKTestURLProtocolLoadedURLs = nil;
++ (NSArray *)loadedURLs {
+    @synchronized(self) {
+        return [MUKTestURLProtocolLoadedURLs copy];
+    }
+}
+
 + (void)resetParameters {
     MUKTestURLProtocolFailsImmediately = NO;
     MUKTestURLProtocolResponseToProduce = nil;
     MUKTestURLProtocolErrorToProduce = nil;
     MUKTestURLProtocolChunksToProduce = nil;
+    
+    @synchronized(self) {
+        MUKTestURLProtocolLoadedURLs = [[NSMutableArray alloc] init];
+    }
 }
 
 #pragma mark - Overrides
@@ -74,6 +85,10 @@ static NSArray *MUKTestURLProtocolChunksToProduce = nil;
     NSURLRequest *request = [self request];
     id client = [self client];
     
+    @synchronized([self class]) {
+        [MUKTestURLProtocolLoadedURLs addObject:[request URL]];
+    }
+    
     if (MUKTestURLProtocolFailsImmediately) {
         [client URLProtocol:self didFailWithError:MUKTestURLProtocolErrorToProduce];
         return;
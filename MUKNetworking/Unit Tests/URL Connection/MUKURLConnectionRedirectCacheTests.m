@@ -0,0 +1,110 @@
+// Copyright (c) 2012, Marco Muccinelli
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+// notice, this list of conditions and the following disclaimer in the
+// documentation and/or other materials provided with the distribution.
+// * Neither the name of the <organization> nor the
+// names of its contributors may be used to endorse or promote products
+// derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+//  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#import "MUKURLConnectionRedirectCacheTests.h"
+#import "MUKURLConnectionRedirectCache.h"
+
+@interface MUKURLConnectionRedirectCacheTests ()
+@property (nonatomic, strong) NSString *cachePath_;
+@end
+
+@implementation MUKURLConnectionRedirectCacheTests
+@synthesize cachePath_;
+
+- (void)setUp {
+    [super setUp];
+    self.cachePath_ = [NSTemporaryDirectory() stringByAppendingPathComponent:@"MUKURLConnectionRedirectCacheTests.plist"];
+    [[NSFileManager defaultManager] removeItemAtPath:self.cachePath_ error:nil];
+}
+
+- (void)tearDown {
+    [[NSFileManager defaultManager] removeItemAtPath:self.cachePath_ error:nil];
+    [super tearDown];
+}
+
+- (void)testChains {
+    NSURL *URL1 = [NSURL URLWithString:@"http://www.apple.com/1"];
+    NSURL *URL2 = [NSURL URLWithString:@"http://www.apple.com/2"];
+    NSURL *URL3 = [NSURL URLWithString:@"http://www.apple.com/3"];
+    
+    MUKURLConnectionRedirectCache *cache = [[MUKURLConnectionRedirectCache alloc] initWithPath:nil];
+    STAssertNil([cache redirectedURLForURL:URL1], nil);
+    
+    [cache setRedirectedURL:URL2 forURL:URL1];
+    [cache setRedirectedURL:URL3 forURL:URL2];
+    STAssertEqualObjects([cache redirectedURLForURL:URL1], URL3, @"Chain is followed");
+    STAssertEqualObjects([cache redirectedURLForURL:URL2], URL3, nil);
+    STAssertNil([cache redirectedURLForURL:URL3], nil);
+    
+    [cache setRedirectedURL:URL1 forURL:URL3];
+    STAssertNil([cache redirectedURLForURL:URL1], @"Loops are not followed");
+    
+    [cache removeAllRedirects];
+    STAssertEquals([cache count], (NSUInteger)0, nil);
+}
+
+- (void)testBoundedTable {
+    NSURL *URL1 = [NSURL URLWithString:@"http://www.apple.com/1"];
+    NSURL *URL2 = [NSURL URLWithString:@"http://www.apple.com/2"];
+    NSURL *URL3 = [NSURL URLWithString:@"http://www.apple.com/3"];
+    NSURL *redirectedURL = [NSURL URLWithString:@"http://www.apple.com/new"];
+    
+    MUKURLConnectionRedirectCache *cache = [[MUKURLConnectionRedirectCache alloc] initWithPath:nil];
+    cache.capacity = 2;
+    
+    [cache setRedirectedURL:redirectedURL forURL:URL1];
+    [cache setRedirectedURL:redirectedURL forURL:URL2];
+    
+    // URL1 becomes most recently used
+    STAssertNotNil([cache redirectedURLForURL:URL1], nil);
+    
+    [cache setRedirectedURL:redirectedURL forURL:URL3];
+    STAssertEquals([cache count], (NSUInteger)2, @"Table is bounded");
+    STAssertNotNil([cache redirectedURLForURL:URL1], nil);
+    STAssertNil([cache redirectedURLForURL:URL2], @"Least recently used redirect is dropped");
+    STAssertNotNil([cache redirectedURLForURL:URL3], nil);
+}
+
+- (void)testPersistence {
+    NSURL *URL = [NSURL URLWithString:@"http://www.apple.com/old"];
+    NSURL *redirectedURL = [NSURL URLWithString:@"http://www.apple.com/new"];
+    
+    MUKURLConnectionRedirectCache *cache = [[MUKURLConnectionRedirectCache alloc] initWithPath:self.cachePath_];
+    [cache setRedirectedURL:redirectedURL forURL:URL];
+    STAssertTrue([cache synchronize], nil);
+    
+    // Simulate relaunch
+    MUKURLConnectionRedirectCache *reloadedCache = [[MUKURLConnectionRedirectCache alloc] initWithPath:self.cachePath_];
+    STAssertEqualObjects([reloadedCache redirectedURLForURL:URL], redirectedURL, @"Redirects survive relaunch");
+    
+    [reloadedCache removeRedirectForURL:URL];
+    STAssertTrue([reloadedCache synchronize], nil);
+    
+    MUKURLConnectionRedirectCache *emptyCache = [[MUKURLConnectionRedirectCache alloc] initWithPath:self.cachePath_];
+    STAssertEquals([emptyCache count], (NSUInteger)0, nil);
+}
+
+@end
@@ -380,6 +380,193 @@
     [self unregisterTestURLProtocol];
 }
 
+- (void)testRedirectCacheRewrite {
+    NSURL *legacyURL = [NSURL URLWithString:@"http://www.apple.com/legacy"];
+    NSURL *redirectedURL = [NSURL URLWithString:@"http://www.apple.com/current"];
+    
+    MUKURLConnectionRedirectCache *cache = [[MUKURLConnectionRedirectCache alloc] initWithPath:nil];
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:legacyURL]];
+    connection.redirectCache = cache;
+    
+    // Only permanent redirects are recorded
+    NSURLRequest *redirectedRequest = [NSURLRequest requestWithURL:redirectedURL];
+    NSHTTPURLResponse *temporaryResponse = [[NSHTTPURLResponse alloc] initWithURL:legacyURL statusCode:302 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    [connection willSendRequest:redirectedRequest redirectResponse:temporaryResponse];
+    STAssertNil([cache redirectedURLForURL:legacyURL], @"302 is not cached");
+    
+    NSHTTPURLResponse *permanentResponse = [[NSHTTPURLResponse alloc] initWithURL:legacyURL statusCode:301 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    [connection willSendRequest:redirectedRequest redirectResponse:permanentResponse];
+    STAssertEqualObjects([cache redirectedURLForURL:legacyURL], redirectedURL, @"301 is cached");
+    
+    __block BOOL completionTestsDone = NO;
+    connection.completionHandler = ^(BOOL success, NSError *error) {
+        STAssertTrue(success, nil);
+        completionTestsDone = YES;
+    };
+    
+    [self registerTestURLProtocol];
+    [connection start];
+    
+    BOOL done = [self waitForCompletion:&completionTestsDone timeout:5.0];
+    if (!done) STFail(@"Timeout");
+    
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], @[redirectedURL], @"Cached redirect skips a round trip");
+    STAssertEqualObjects([connection.request URL], legacyURL, @"Request is not changed");
+    
+    [self unregisterTestURLProtocol];
+}
+
+- (void)testRedirectCacheVeto {
+    NSURL *legacyURL = [NSURL URLWithString:@"http://www.apple.com/legacy"];
+    NSURL *redirectedURL = [NSURL URLWithString:@"http://www.apple.com/current"];
+    NSURL *overridingURL = [NSURL URLWithString:@"http://www.apple.com/mirror"];
+    
+    MUKURLConnectionRedirectCache *cache = [[MUKURLConnectionRedirectCache alloc] initWithPath:nil];
+    [cache setRedirectedURL:redirectedURL forURL:legacyURL];
+    
+    MUKURLConnection *vetoingConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:legacyURL]];
+    vetoingConnection.redirectCache = cache;
+    vetoingConnection.redirectHandler = ^NSURLRequest *(NSURLRequest *request, NSURLResponse *redirectResponse)
+    {
+        if (redirectResponse) {
+            STAssertEquals([(NSHTTPURLResponse *)redirectResponse statusCode], (NSInteger)301, @"Cached rewrite looks like a permanent redirect");
+            return nil;
+        }
+        
+        return request;
+    };
+    
+    MUKURLConnection *overridingConnection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:legacyURL]];
+    overridingConnection.redirectCache = cache;
+    overridingConnection.redirectHandler = ^NSURLRequest *(NSURLRequest *request, NSURLResponse *redirectResponse)
+    {
+        if (redirectResponse) {
+            return [NSURLRequest requestWithURL:overridingURL];
+        }
+        
+        return request;
+    };
+    
+    __block BOOL vetoingCompletionDone = NO, overridingCompletionDone = NO;
+    vetoingConnection.completionHandler = ^(BOOL success, NSError *error) {
+        vetoingCompletionDone = YES;
+    };
+    overridingConnection.completionHandler = ^(BOOL success, NSError *error) {
+        overridingCompletionDone = YES;
+    };
+    
+    [self registerTestURLProtocol];
+    
+    [vetoingConnection start];
+    BOOL done1 = [self waitForCompletion:&vetoingCompletionDone timeout:5.0];
+    
+    STAssertEqualObjects([cache redirectedURLForURL:legacyURL], redirectedURL, @"Veto of cached rewrite does not change cache");
+    
+    [overridingConnection start];
+    BOOL done2 = [self waitForCompletion:&overridingCompletionDone timeout:5.0];
+    
+    if (!done1 || !done2) {
+        STFail(@"Timeout");
+    }
+    
+    NSArray *expectedURLs = @[legacyURL, overridingURL];
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], expectedURLs, @"Redirect handler vetoes or overrides cached rewrite");
+    STAssertEqualObjects([cache redirectedURLForURL:legacyURL], redirectedURL, @"Override of cached rewrite does not change cache");
+    
+    [self unregisterTestURLProtocol];
+}
+
+- (void)testRedirectCacheRecordsHandlerResult {
+    NSURL *legacyURL = [NSURL URLWithString:@"http://www.apple.com/legacy"];
+    NSURL *redirectedURL = [NSURL URLWithString:@"http://www.apple.com/current"];
+    NSURL *overridingURL = [NSURL URLWithString:@"http://www.apple.com/mirror"];
+    
+    MUKURLConnectionRedirectCache *cache = [[MUKURLConnectionRedirectCache alloc] initWithPath:nil];
+    NSHTTPURLResponse *permanentResponse = [[NSHTTPURLResponse alloc] initWithURL:legacyURL statusCode:301 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    
+    __block BOOL vetoes = YES;
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:legacyURL]];
+    connection.redirectCache = cache;
+    connection.redirectHandler = ^NSURLRequest *(NSURLRequest *request, NSURLResponse *redirectResponse)
+    {
+        return (vetoes ? nil : [NSURLRequest requestWithURL:overridingURL]);
+    };
+    
+    [connection willSendRequest:[NSURLRequest requestWithURL:redirectedURL] redirectResponse:permanentResponse];
+    STAssertNil([cache redirectedURLForURL:legacyURL], @"Vetoed permanent redirect is not recorded");
+    
+    vetoes = NO;
+    [connection willSendRequest:[NSURLRequest requestWithURL:redirectedURL] redirectResponse:permanentResponse];
+    STAssertEqualObjects([cache redirectedURLForURL:legacyURL], overridingURL, @"Overridden permanent redirect records returned request");
+}
+
+- (void)testRedirectCacheInvalidation {
+    NSURL *legacyURL = [NSURL URLWithString:@"http://www.apple.com/legacy"];
+    NSURL *redirectedURL = [NSURL URLWithString:@"http://www.apple.com/current"];
+    
+    MUKURLConnectionRedirectCache *cache = [[MUKURLConnectionRedirectCache alloc] initWithPath:nil];
+    [cache setRedirectedURL:redirectedURL forURL:legacyURL];
+    
+    __block BOOL completionDone = NO;
+    MUKURLConnection *connection = [[MUKURLConnection alloc] initWithRequest:[NSURLRequest requestWithURL:legacyURL]];
+    connection.redirectCache = cache;
+    connection.completionHandler = ^(BOOL success, NSError *error) {
+        completionDone = YES;
+    };
+    
+    // Destination answers with an HTTP error
+    [self registerTestURLProtocol];
+    NSHTTPURLResponse *notFoundResponse = [[NSHTTPURLResponse alloc] initWithURL:redirectedURL statusCode:404 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    [MUKTestURLProtocol setResponseToProduce:notFoundResponse];
+    
+    [connection start];
+    BOOL done1 = [self waitForCompletion:&completionDone timeout:5.0];
+    
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], @[redirectedURL], @"Cached redirect is used");
+    STAssertNil([cache redirectedURLForURL:legacyURL], @"Redirect is removed when destination is not found");
+    
+    // Destination is temporarily unavailable
+    [self registerTestURLProtocol];
+    [cache setRedirectedURL:redirectedURL forURL:legacyURL];
+    NSHTTPURLResponse *unavailableResponse = [[NSHTTPURLResponse alloc] initWithURL:redirectedURL statusCode:503 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    [MUKTestURLProtocol setResponseToProduce:unavailableResponse];
+    
+    completionDone = NO;
+    [connection start];
+    BOOL done2 = [self waitForCompletion:&completionDone timeout:5.0];
+    
+    STAssertEqualObjects([cache redirectedURLForURL:legacyURL], redirectedURL, @"Redirect is kept when destination error could be transient");
+    
+    // Device is offline
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setFailsImmediately:YES];
+    [MUKTestURLProtocol setErrorToProduce:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorNotConnectedToInternet userInfo:nil]];
+    
+    completionDone = NO;
+    [connection start];
+    BOOL done3 = [self waitForCompletion:&completionDone timeout:5.0];
+    
+    STAssertEqualObjects([cache redirectedURLForURL:legacyURL], redirectedURL, @"Redirect is kept while offline");
+    
+    // Destination host can not be reached
+    [self registerTestURLProtocol];
+    [MUKTestURLProtocol setFailsImmediately:YES];
+    [MUKTestURLProtocol setErrorToProduce:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCannotConnectToHost userInfo:nil]];
+    
+    completionDone = NO;
+    [connection start];
+    BOOL done4 = [self waitForCompletion:&completionDone timeout:5.0];
+    
+    if (!done1 || !done2 || !done3 || !done4) {
+        STFail(@"Timeout");
+    }
+    
+    STAssertEqualObjects([MUKTestURLProtocol loadedURLs], @[redirectedURL], @"Cached redirect is used");
+    STAssertNil([cache redirectedURLForURL:legacyURL], @"Redirect is removed when destination host can not be reached");
+    
+    [self unregisterTestURLProtocol];
+}
+
 #pragma mark - Private
 
 - (NSData *)mergedChunksToIndex_:(NSInteger)index chunks_:(NSArray *)chunks {